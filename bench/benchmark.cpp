@@ -0,0 +1,298 @@
+// transfer benchmarks against mock portals in this process, so no network is needed.
+// usage: siaskynetpp_benchmark [substring of benchmark names to run]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <thread>
+
+#include <unistd.h>
+
+#include <siaskynet.hpp>
+#include <siaskynet_multiportal.hpp>
+
+#include "mock_portal.hpp"
+#include "skystream.hpp"
+
+using namespace std::chrono;
+
+static std::string filter;
+
+static bool selected(std::string const & name)
+{
+	return name.find(filter) != std::string::npos;
+}
+
+// one line per benchmark: operations, mean and tail time per operation, and throughput
+static void report(std::string const & name, std::vector<double> seconds, size_t bytes_per_operation)
+{
+	std::sort(seconds.begin(), seconds.end());
+	double total = std::accumulate(seconds.begin(), seconds.end(), 0.0);
+	auto at = [&](double fraction) { return seconds[std::min(seconds.size() - 1, size_t(fraction * seconds.size()))]; };
+	std::cout << std::left << std::setw(36) << name << std::right
+		<< std::setw(8) << seconds.size() << " ops"
+		<< std::fixed << std::setprecision(3)
+		<< std::setw(10) << total / seconds.size() * 1000 << " ms mean"
+		<< std::setw(10) << at(0.5) * 1000 << " ms p50"
+		<< std::setw(10) << at(0.99) * 1000 << " ms p99";
+	if (bytes_per_operation) {
+		std::cout << std::setw(10) << std::setprecision(1) << bytes_per_operation * seconds.size() / total / (1024 * 1024) << " MiB/s";
+	}
+	std::cout << std::endl;
+}
+
+template <typename Operation>
+static void measure(std::string const & name, size_t operations, size_t bytes_per_operation, Operation operation)
+{
+	if (!selected(name)) { return; }
+	std::vector<double> seconds;
+	for (size_t index = 0; index < operations; ++ index) {
+		auto start = steady_clock::now();
+		operation(index);
+		seconds.push_back(duration<double>(steady_clock::now() - start).count());
+	}
+	report(name, seconds, bytes_per_operation);
+}
+
+static std::vector<uint8_t> randomData(size_t size)
+{
+	std::vector<uint8_t> result(size);
+	uint64_t state = size;
+	for (auto & byte : result) {
+		state = state * 6364136223846793005 + 1442695040888963407;
+		byte = state >> 56;
+	}
+	return result;
+}
+
+static void benchmarkTransfers(sia::mock_portal & mock)
+{
+	sia::skynet portal(mock.options());
+	for (size_t size : {1024 * 1024, 16 * 1024 * 1024}) {
+		std::string suffix = "/" + std::to_string(size >> 20) + "MiB";
+		auto data = randomData(size);
+		std::string skylink;
+		measure("upload" + suffix, size > 1024 * 1024 ? 8 : 32, size, [&](size_t) {
+			skylink = portal.upload(sia::skynet::upload_data::borrowed("bench", data.data(), data.size()));
+		});
+		if (!skylink.size()) {
+			skylink = portal.upload(sia::skynet::upload_data::borrowed("bench", data.data(), data.size()));
+		}
+		measure("download" + suffix, size > 1024 * 1024 ? 8 : 32, size, [&](size_t) {
+			portal.download(skylink);
+		});
+		measure("download_range/64KiB" + suffix, 64, 64 * 1024, [&](size_t index) {
+			portal.download(skylink, {{(index * 7919 * 4096) % (size - 64 * 1024), 64 * 1024}});
+		});
+	}
+}
+
+static void benchmarkSmallObjects(sia::mock_portal & mock)
+{
+	sia::skynet portal(mock.options());
+	auto data = randomData(1024);
+	std::string skylink;
+	measure("small_upload/1KiB", 200, 0, [&](size_t index) {
+		data[0] = index;
+		skylink = portal.upload("small", data);
+	});
+	if (!skylink.size()) {
+		skylink = portal.upload("small", data);
+	}
+	measure("small_download/1KiB", 200, 0, [&](size_t) {
+		portal.download(skylink);
+	});
+	measure("small_query", 200, 0, [&](size_t) {
+		portal.query(skylink);
+	});
+}
+
+static void benchmarkSelection()
+{
+	// portal selection alone: nothing is transferred, so the portals need not exist
+	sia::skynet_multiportal multiportal(milliseconds(0), true);
+	for (size_t index = 0; index < 16; ++ index) {
+		multiportal.ensure_portal({"http://portal-" + std::to_string(index) + ".invalid", "/skynet/skyfile", "file", "files[]"});
+	}
+	for (unsigned threads : {1u, 4u}) {
+		std::string name = "begin_transfer/" + std::to_string(threads) + "thread";
+		if (!selected(name)) { continue; }
+		size_t const operations = 1000000 / threads;
+		std::vector<std::thread> workers;
+		auto start = steady_clock::now();
+		for (unsigned thread = 0; thread < threads; ++ thread) {
+			workers.emplace_back([&]() {
+				for (size_t index = 0; index < operations; ++ index) {
+					auto transfer = multiportal.begin_transfer(sia::skynet_multiportal::download_kind);
+					multiportal.end_transfer(transfer, 1024);
+				}
+			});
+		}
+		for (auto & worker : workers) {
+			worker.join();
+		}
+		double seconds = duration<double>(steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(36) << name << std::right
+			<< std::setw(8) << operations * threads << " ops"
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(10) << seconds / (operations * threads) * 1e9 << " ns per begin and end" << std::endl;
+	}
+}
+
+static void benchmarkFailover()
+{
+	if (!selected("multiportal_download/faulty")) { return; }
+
+	// one clean portal, one failing half its requests, and one slow and narrow
+	sia::mock_portal clean, failing, slow;
+	auto data = randomData(4 * 1024 * 1024);
+	std::string skylink;
+	for (auto * mock : {&clean, &failing, &slow}) {
+		skylink = sia::skynet(mock->options()).upload(sia::skynet::upload_data::borrowed("bench", data.data(), data.size()));
+	}
+	failing.inject({milliseconds(0), 0, 0.5, 0.1});
+	slow.inject({milliseconds(50), 20 * 1024 * 1024, 0, 0});
+
+	sia::skynet_multiportal multiportal(milliseconds(0), true);
+	for (auto * mock : {&clean, &failing, &slow}) {
+		multiportal.ensure_portal(mock->options());
+	}
+	// downloads cut off halfway are resumed on another portal, and still describe the whole file
+	measure("multiportal_download/faulty", 40, data.size(), [&](size_t) {
+		auto result = multiportal.download(skylink);
+		if (result.data != data) {
+			throw std::runtime_error("multiportal download was wrong");
+		}
+		if (result.metadata.len != data.size() || result.dataranges != std::vector<std::pair<size_t, size_t>>{{0, data.size()}}) {
+			throw std::runtime_error("multiportal download misreported its length or ranges");
+		}
+	});
+	size_t const middle = data.size() / 2;
+	std::vector<std::pair<size_t, size_t>> const expected{{100, 1024 * 1024}, {middle, data.size() - middle}};
+	for (size_t index = 0; index < 10; ++ index) {
+		auto result = multiportal.download(skylink, {{100, 1024 * 1024}, {middle, sia::skynet::to_end}});
+		if (result.data.size() != 1024 * 1024 + data.size() - middle || !std::equal(data.begin() + middle, data.end(), result.data.begin() + 1024 * 1024)) {
+			throw std::runtime_error("multiportal range download was wrong");
+		}
+		if (result.dataranges != expected) {
+			throw std::runtime_error("multiportal range download misreported its ranges");
+		}
+	}
+}
+
+static void benchmarkDigests()
+{
+	crypto cryptography;
+	for (size_t size : {64 * 1024, 1024 * 1024, 16 * 1024 * 1024}) {
+		std::string suffix = size < 1024 * 1024 ? "/" + std::to_string(size >> 10) + "KiB" : "/" + std::to_string(size >> 20) + "MiB";
+		auto data = randomData(size);
+		measure("digests" + suffix, size > 1024 * 1024 ? 16 : 128, size, [&](size_t) {
+			cryptography.digests({&data});
+		});
+		measure("digest_one" + suffix, size > 1024 * 1024 ? 16 : 128, size, [&](size_t) {
+			cryptography.digests({&data}, {"sha512_256"});
+		});
+	}
+}
+
+static void benchmarkSkystream(sia::mock_portal & mock)
+{
+	if (!selected("skystream")) { return; }
+
+	// skystream uses the default portal, so the portal list is pointed at the mock,
+	// without the fallback portal that retries would otherwise reach over the network
+	char directory[] = "/tmp/siaskynetpp-benchmark-XXXXXX";
+	if (!mkdtemp(directory)) { throw std::runtime_error("Failed to create a temporary directory"); }
+	std::string list = std::string(directory) + "/portals.json";
+	{
+		std::ofstream file(list);
+		file << "[{\"link\": \"" << mock.options().url << "\"}]";
+	}
+	sia::skynet::configure_portal_cache(list, hours(24), false);
+
+	// skystream logs each metadata document it writes
+	auto * logging = std::cerr.rdbuf(nullptr);
+
+	size_t const block = 1024 * 1024;
+	size_t const blocks = 32;
+	auto data = randomData(block);
+	skystream writer;
+	std::vector<double> seconds;
+	for (size_t index = 0; index < blocks; ++ index) {
+		auto start = steady_clock::now();
+		writer.write(data, "bytes", index * block);
+		seconds.push_back(duration<double>(steady_clock::now() - start).count());
+	}
+	std::cerr.rdbuf(logging);
+	report("skystream_write/1MiB", seconds, block);
+
+	// the last write's time includes waiting for the pipeline to drain
+	if (selected("skystream_write_pipelined")) {
+		std::cerr.rdbuf(nullptr);
+		skystream pipelined;
+		pipelined.pipeline(4);
+		seconds.clear();
+		for (size_t index = 0; index < blocks; ++ index) {
+			auto start = steady_clock::now();
+			pipelined.write(data, "bytes", index * block);
+			if (index + 1 == blocks) { pipelined.flush(); }
+			seconds.push_back(duration<double>(steady_clock::now() - start).count());
+		}
+		std::cerr.rdbuf(logging);
+		report("skystream_write_pipelined/1MiB", seconds, block);
+	}
+
+	seconds.clear();
+	skystream reader(writer.identifiers());
+	auto range = reader.span("bytes");
+	for (double offset = range.first; offset < range.second;) {
+		auto start = steady_clock::now();
+		auto read = reader.read("bytes", offset);
+		seconds.push_back(duration<double>(steady_clock::now() - start).count());
+		if (read.empty()) { throw std::runtime_error("skystream read nothing"); }
+		offset += read.size();
+	}
+	report("skystream_read/1MiB", seconds, block);
+
+	// seeks visit each block twice, the second time through the span index
+	if (selected("skystream_seek")) {
+		skystream seeker(writer.identifiers());
+		seeker.read_ahead(0);
+		seconds.clear();
+		for (size_t index = 0; index < blocks * 2; ++ index) {
+			auto start = steady_clock::now();
+			seeker.read("bytes", (index * 7919 % blocks) * block + 1);
+			seconds.push_back(duration<double>(steady_clock::now() - start).count());
+		}
+		report("skystream_seek/1MiB", seconds, block);
+	}
+
+	sia::skynet::configure_portal_cache({});
+	unlink(list.c_str());
+	rmdir(directory);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		std::cerr << "Usage: " << argv[0] << " [filter]" << std::endl;
+		return -1;
+	}
+	if (argc == 2) {
+		filter = argv[1];
+	}
+
+	sia::mock_portal mock;
+	benchmarkTransfers(mock);
+	benchmarkSmallObjects(mock);
+	benchmarkSelection();
+	benchmarkFailover();
+	benchmarkDigests();
+	benchmarkSkystream(mock);
+
+	return 0;
+}
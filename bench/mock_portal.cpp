@@ -0,0 +1,512 @@
+#include "mock_portal.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace sia {
+
+static double chance();
+static void throttle(std::chrono::steady_clock::time_point start, size_t bytes, size_t bandwidth);
+static std::string lowercase(std::string text);
+static std::string urlDecode(std::string const & text);
+static std::string queryValue(std::string const & target, std::string const & name);
+static std::string headerParameter(std::string const & header, std::string const & name);
+static std::string hashSkylink(std::vector<std::pair<std::string, mock_portal::file>> const & subfiles);
+static std::pair<std::string, mock_portal::file> const * findSubfile(mock_portal::skyfile const & skyfile, std::string const & name);
+static char const * statusText(int status);
+
+mock_portal::mock_portal()
+{
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0) { throw std::runtime_error(std::string("Failed to create socket: ") + strerror(errno)); }
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	socklen_t length = sizeof(address);
+	if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1024) != 0 || getsockname(listener, (sockaddr *)&address, &length) != 0) {
+		std::string error = strerror(errno);
+		close(listener);
+		throw std::runtime_error("Failed to listen on loopback: " + error);
+	}
+	port = ntohs(address.sin_port);
+
+	acceptor = std::thread(&mock_portal::accept_connections, this);
+}
+
+mock_portal::~mock_portal()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		// wakes accept and every blocked recv
+		shutdown(listener, SHUT_RDWR);
+		for (int connection : connections) {
+			shutdown(connection, SHUT_RDWR);
+		}
+	}
+	acceptor.join();
+	for (auto & handler : handlers) {
+		handler.join();
+	}
+	close(listener);
+}
+
+skynet::portal_options mock_portal::options() const
+{
+	return {
+		url: "http://127.0.0.1:" + std::to_string(port),
+		uploadPath: "/skynet/skyfile",
+		fileFieldname: "file",
+		directoryFileFieldname: "files[]"
+	};
+}
+
+void mock_portal::inject(faults const & faults)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	injected = faults;
+}
+
+void mock_portal::accept_connections()
+{
+	while (true) {
+		int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping) {
+			if (connection >= 0) { close(connection); }
+			return;
+		}
+		if (connection < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) { continue; }
+			return;
+		}
+		int yes = 1;
+		setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		connections.insert(connection);
+		handlers.emplace_back(&mock_portal::serve, this, connection);
+	}
+}
+
+void mock_portal::serve(int connection)
+{
+	std::string buffer;
+	while (true) {
+		size_t end;
+		while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+			if (!read_more(connection, buffer)) { goto done; }
+		}
+		std::string head = buffer.substr(0, end + 2);
+		buffer.erase(0, end + 4);
+
+		faults limits;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			limits = injected;
+		}
+		++ requests;
+
+		// the request line, then headers keyed in lowercase
+		size_t line_end = head.find("\r\n");
+		std::string line = head.substr(0, line_end);
+		std::string method = line.substr(0, line.find(' '));
+		std::string target = line.substr(method.size() + 1, line.rfind(' ') - method.size() - 1);
+		std::map<std::string, std::string> headers;
+		for (size_t start = line_end + 2; start < head.size();) {
+			size_t next = head.find("\r\n", start);
+			size_t colon = head.find(':', start);
+			if (colon < next) {
+				size_t value = head.find_first_not_of(' ', colon + 1);
+				headers[lowercase(head.substr(start, colon - start))] = head.substr(value, next - value);
+			}
+			start = next + 2;
+		}
+
+		std::string body;
+		if (headers["expect"] == "100-continue") {
+			static char const proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+			if (!send(connection, proceed, sizeof(proceed) - 1, {})) { break; }
+		}
+		if (lowercase(headers["transfer-encoding"]) == "chunked") {
+			while (true) {
+				size_t size_end;
+				while ((size_end = buffer.find("\r\n")) == std::string::npos) {
+					if (!read_more(connection, buffer)) { goto done; }
+				}
+				size_t size = std::stoul(buffer.substr(0, size_end), nullptr, 16);
+				buffer.erase(0, size_end + 2);
+				if (!receive(connection, buffer, size + 2, limits)) { goto done; }
+				body.append(buffer, 0, size);
+				buffer.erase(0, size + 2);
+				if (!size) { break; }
+			}
+		} else if (headers.count("content-length")) {
+			size_t size = std::stoul(headers["content-length"]);
+			if (!receive(connection, buffer, size, limits)) { break; }
+			body = buffer.substr(0, size);
+			buffer.erase(0, size);
+		}
+
+		if (limits.latency.count()) {
+			std::this_thread::sleep_for(limits.latency);
+		}
+
+		bool ok;
+		if (chance() < limits.failure_rate) {
+			static char const failure[] = "injected failure";
+			ok = reply(connection, 503, "Content-Type: text/plain\r\n", failure, sizeof(failure) - 1, method != "HEAD", limits);
+		} else if (method == "POST") {
+			ok = reply_upload(connection, target, headers, body, limits);
+		} else if (method == "GET" || method == "HEAD") {
+			ok = reply_download(connection, target, headers, method == "HEAD", limits);
+		} else {
+			ok = reply(connection, 405, "", nullptr, 0, true, limits);
+		}
+		if (!ok || lowercase(headers["connection"]) == "close") { break; }
+	}
+done:
+	std::lock_guard<std::mutex> lock(mutex);
+	connections.erase(connection);
+	close(connection);
+}
+
+bool mock_portal::read_more(int connection, std::string & buffer)
+{
+	char chunk[64 * 1024];
+	ssize_t size = recv(connection, chunk, sizeof(chunk), 0);
+	if (size <= 0) { return false; }
+	buffer.append(chunk, size);
+	bytes_received += size;
+	return true;
+}
+
+bool mock_portal::receive(int connection, std::string & buffer, size_t size, faults const & limits)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t initial = buffer.size();
+	while (buffer.size() < size) {
+		if (!read_more(connection, buffer)) { return false; }
+		if (limits.bandwidth) {
+			throttle(start, buffer.size() - initial, limits.bandwidth);
+		}
+	}
+	return true;
+}
+
+bool mock_portal::send(int connection, char const * data, size_t size, faults const & limits)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (size_t sent = 0; sent < size;) {
+		ssize_t result = ::send(connection, data + sent, std::min<size_t>(size - sent, 64 * 1024), MSG_NOSIGNAL);
+		if (result < 0 && errno == EINTR) { continue; }
+		if (result <= 0) { return false; }
+		sent += result;
+		bytes_sent += result;
+		if (limits.bandwidth) {
+			throttle(start, sent, limits.bandwidth);
+		}
+	}
+	return true;
+}
+
+bool mock_portal::reply(int connection, int status, std::string const & headers, char const * body, size_t size, bool send_body, faults const & limits)
+{
+	std::string head = "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n"
+		+ headers
+		+ "Content-Length: " + std::to_string(size) + "\r\n"
+		+ "\r\n";
+	if (!send(connection, head.data(), head.size(), limits)) { return false; }
+	if (!send_body || !size) { return true; }
+
+	if (chance() < limits.disconnect_rate) {
+		send(connection, body, size / 2, limits);
+		return false;
+	}
+	return send(connection, body, size, limits);
+}
+
+bool mock_portal::reply_upload(int connection, std::string const & target, std::map<std::string, std::string> & headers, std::string const & body, faults const & limits)
+{
+	if (target.substr(0, target.find('?')) != "/skynet/skyfile") {
+		return reply(connection, 404, "", nullptr, 0, true, limits);
+	}
+
+	std::string boundary = headerParameter(headers["content-type"], "boundary");
+	if (!boundary.size()) {
+		static char const error[] = "no multipart boundary";
+		return reply(connection, 400, "", error, sizeof(error) - 1, true, limits);
+	}
+	boundary = "--" + boundary;
+
+	auto uploaded = std::make_shared<skyfile>();
+	uploaded->filename = urlDecode(queryValue(target, "filename"));
+	for (size_t start = body.find(boundary); start != std::string::npos;) {
+		start += boundary.size();
+		if (0 == body.compare(start, 2, "--")) { break; }
+		size_t end = body.find("\r\n" + boundary, start);
+		size_t headers_end = body.find("\r\n\r\n", start);
+		if (end == std::string::npos || headers_end == std::string::npos || headers_end > end) { break; }
+
+		std::string part_headers = lowercase(body.substr(start, headers_end - start));
+		std::string original = body.substr(start, headers_end - start);
+		file content;
+		std::string filename;
+		for (size_t line = 0; line < part_headers.size();) {
+			size_t next = std::min(part_headers.find("\r\n", line), part_headers.size());
+			if (0 == part_headers.compare(line, 20, "content-disposition:")) {
+				// the filename keeps its case
+				filename = headerParameter(original.substr(line, next - line), "filename");
+			} else if (0 == part_headers.compare(line, 13, "content-type:")) {
+				content.contenttype = original.substr(line + 13, next - line - 13);
+				content.contenttype.erase(0, content.contenttype.find_first_not_of(' '));
+			}
+			line = next + 2;
+		}
+		content.data.assign(body.begin() + headers_end + 4, body.begin() + end);
+		if (!content.contenttype.size()) { content.contenttype = "application/octet-stream"; }
+		auto same = std::find_if(uploaded->subfiles.begin(), uploaded->subfiles.end(), [&](auto & subfile) { return subfile.first == filename; });
+		if (same != uploaded->subfiles.end()) {
+			same->second = std::move(content);
+		} else {
+			uploaded->subfiles.emplace_back(filename, std::move(content));
+		}
+		start = end + 2;
+	}
+	if (uploaded->subfiles.empty()) {
+		static char const error[] = "no files uploaded";
+		return reply(connection, 400, "", error, sizeof(error) - 1, true, limits);
+	}
+	if (!uploaded->filename.size()) { uploaded->filename = uploaded->subfiles.begin()->first; }
+
+	std::string skylink = hashSkylink(uploaded->subfiles);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		skyfiles[skylink] = uploaded;
+	}
+	std::string result = nlohmann::json{{"skylink", skylink}, {"merkleroot", ""}, {"bitfield", 0}}.dump();
+	return reply(connection, 200, "Content-Type: application/json\r\n", result.data(), result.size(), true, limits);
+}
+
+bool mock_portal::reply_download(int connection, std::string const & target, std::map<std::string, std::string> & headers, bool head, faults const & limits)
+{
+	std::string path = urlDecode(target.substr(1, target.find('?') - 1));
+	std::string skylink = path.substr(0, path.find('/'));
+	std::string subpath = skylink.size() < path.size() ? path.substr(skylink.size() + 1) : std::string();
+	while (subpath.size() && subpath.back() == '/') { subpath.pop_back(); }
+
+	std::shared_ptr<skyfile const> found;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto entry = skyfiles.find(skylink);
+		if (entry != skyfiles.end()) { found = entry->second; }
+	}
+	if (found && subpath.size() && !findSubfile(*found, subpath)) { found.reset(); }
+	if (!found) {
+		static char const error[] = "not found";
+		return reply(connection, 404, "", error, sizeof(error) - 1, !head, limits);
+	}
+
+	// a subfile or a lone file is sent as it is, and several as their concatenation
+	std::string filename = subpath.size() ? subpath : found->filename;
+	std::vector<uint8_t> concatenated;
+	std::vector<uint8_t> const * content;
+	std::string contenttype;
+	nlohmann::json subfiles = nlohmann::json::object();
+	if (subpath.size() || found->subfiles.size() == 1) {
+		auto & entry = subpath.size() ? *findSubfile(*found, subpath) : found->subfiles.front();
+		content = &entry.second.data;
+		contenttype = entry.second.contenttype;
+		subfiles[entry.first] = {{"filename", entry.first}, {"contenttype", contenttype}, {"len", content->size()}, {"offset", 0}};
+	} else {
+		// like real portals, each subfile's offset in the concatenation is reported
+		for (auto & entry : found->subfiles) {
+			subfiles[entry.first] = {{"filename", entry.first}, {"contenttype", entry.second.contenttype}, {"len", entry.second.data.size()}, {"offset", concatenated.size()}};
+			concatenated.insert(concatenated.end(), entry.second.data.begin(), entry.second.data.end());
+		}
+		content = &concatenated;
+		contenttype = "application/octet-stream";
+	}
+	size_t size = content->size();
+	nlohmann::json metadata = {{"filename", filename}, {"length", size}, {"subfiles", subfiles}};
+
+	std::string common = "Content-Disposition: inline; filename=\"" + filename + "\"\r\n"
+		+ "Skynet-Skylink: " + skylink + "\r\n"
+		+ "Skynet-File-Metadata: " + metadata.dump() + "\r\n"
+		+ "Accept-Ranges: bytes\r\n";
+
+	// ranges are inclusive pairs; an open end reads to the end of the file
+	std::vector<std::pair<size_t, size_t>> ranges;
+	std::string range = headers["range"];
+	if (0 == range.compare(0, 6, "bytes=")) {
+		for (size_t start = 6; start < range.size();) {
+			size_t next = std::min(range.find(',', start), range.size());
+			std::string spec = range.substr(start, next - start);
+			size_t dash = spec.find('-');
+			if (dash == std::string::npos || dash == 0) {
+				static char const error[] = "unsupported range";
+				return reply(connection, 416, "", error, sizeof(error) - 1, !head, limits);
+			}
+			size_t first = std::stoul(spec.substr(0, dash));
+			size_t last = dash + 1 < spec.size() ? std::stoul(spec.substr(dash + 1)) : size - 1;
+			if (first >= size || last < first) {
+				std::string unsatisfiable = "Content-Range: bytes */" + std::to_string(size) + "\r\n";
+				return reply(connection, 416, unsatisfiable, nullptr, 0, !head, limits);
+			}
+			ranges.emplace_back(first, std::min(last, size - 1));
+			start = next + 1;
+		}
+	}
+
+	if (ranges.empty()) {
+		return reply(connection, 200, common + "Content-Type: " + contenttype + "\r\n", (char const *)content->data(), size, !head, limits);
+	}
+	if (ranges.size() == 1) {
+		std::string content_range = "Content-Range: bytes " + std::to_string(ranges[0].first) + "-" + std::to_string(ranges[0].second) + "/" + std::to_string(size) + "\r\n";
+		return reply(connection, 206, common + content_range + "Content-Type: " + contenttype + "\r\n", (char const *)content->data() + ranges[0].first, ranges[0].second + 1 - ranges[0].first, !head, limits);
+	}
+	static char const boundary[] = "mockportalboundary";
+	std::string parts;
+	for (auto & part : ranges) {
+		parts += std::string("--") + boundary + "\r\n"
+			+ "Content-Type: " + contenttype + "\r\n"
+			+ "Content-Range: bytes " + std::to_string(part.first) + "-" + std::to_string(part.second) + "/" + std::to_string(size) + "\r\n"
+			+ "\r\n";
+		parts.append((char const *)content->data() + part.first, part.second + 1 - part.first);
+		parts += "\r\n";
+	}
+	parts += std::string("--") + boundary + "--\r\n";
+	return reply(connection, 206, common + "Content-Type: multipart/byteranges; boundary=" + boundary + "\r\n", parts.data(), parts.size(), !head, limits);
+}
+
+double chance()
+{
+	static thread_local std::mt19937_64 random(std::random_device{}());
+	return std::uniform_real_distribution<double>(0, 1)(random);
+}
+
+void throttle(std::chrono::steady_clock::time_point start, size_t bytes, size_t bandwidth)
+{
+	std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(double(bytes) / bandwidth)));
+}
+
+std::string lowercase(std::string text)
+{
+	std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+	return text;
+}
+
+std::string urlDecode(std::string const & text)
+{
+	std::string result;
+	for (size_t index = 0; index < text.size(); ++ index) {
+		if (text[index] == '%' && index + 2 < text.size()) {
+			result += (char)std::stoi(text.substr(index + 1, 2), nullptr, 16);
+			index += 2;
+		} else if (text[index] == '+') {
+			result += ' ';
+		} else {
+			result += text[index];
+		}
+	}
+	return result;
+}
+
+std::string queryValue(std::string const & target, std::string const & name)
+{
+	size_t query = target.find('?');
+	while (query != std::string::npos) {
+		size_t next = target.find('&', query + 1);
+		std::string pair = target.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+		if (0 == pair.compare(0, name.size() + 1, name + "=")) {
+			return pair.substr(name.size() + 1);
+		}
+		query = next;
+	}
+	return {};
+}
+
+std::string headerParameter(std::string const & header, std::string const & name)
+{
+	size_t start = lowercase(header).find(name + "=");
+	if (start == std::string::npos) { return {}; }
+	start += name.size() + 1;
+	if (start < header.size() && header[start] == '"') {
+		return header.substr(start + 1, header.find('"', start + 1) - start - 1);
+	}
+	return header.substr(start, header.find(';', start) - start);
+}
+
+std::pair<std::string, mock_portal::file> const * findSubfile(mock_portal::skyfile const & skyfile, std::string const & name)
+{
+	for (auto & subfile : skyfile.subfiles) {
+		if (subfile.first == name) { return &subfile; }
+	}
+	return nullptr;
+}
+
+std::string hashSkylink(std::vector<std::pair<std::string, mock_portal::file>> const & subfiles)
+{
+	// not a real merkle root, but the same content gets the same link on every mock:
+	// std::hash of each subfile, spread over 34 bytes by splitmix64 and base64url
+	// encoded to 46 characters
+	uint8_t bytes[34] = {};
+	uint64_t state = 0;
+	for (auto & subfile : subfiles) {
+		for (size_t hash : {
+			std::hash<std::string>()(subfile.first),
+			std::hash<std::string>()(subfile.second.contenttype),
+			std::hash<std::string_view>()(std::string_view((char const *)subfile.second.data.data(), subfile.second.data.size()))
+		}) {
+			state = (state ^ hash) * 0x100000001b3;
+		}
+	}
+	for (size_t lane = 0; lane < 4; ++ lane) {
+		uint64_t mixed = (state += 0x9e3779b97f4a7c15);
+		mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9;
+		mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111eb;
+		mixed ^= mixed >> 31;
+		memcpy(bytes + lane * 8, &mixed, 8);
+	}
+	static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	std::string result;
+	for (size_t bit = 0; result.size() < 46; bit += 6) {
+		unsigned value = 0;
+		for (size_t index = 0; index < 6; ++ index) {
+			size_t position = bit + index;
+			value = (value << 1) | (position < 34 * 8 ? (bytes[position / 8] >> (7 - position % 8)) & 1 : 0);
+		}
+		result += alphabet[value];
+	}
+	return result;
+}
+
+char const * statusText(int status)
+{
+	switch (status) {
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 416: return "Range Not Satisfiable";
+	case 503: return "Service Unavailable";
+	default: return "Unknown";
+	}
+}
+
+} // namespace sia
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <siaskynet.hpp>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace sia {
+
+// a skynet portal served from memory on a loopback port, so transfers can be
+// measured without a network.  it takes multipart uploads to /skynet/skyfile,
+// and answers GET and HEAD of skylinks and their subfiles, with ranges and the
+// skynet-file-metadata header.  faults can be injected while it runs.
+class mock_portal {
+public:
+	mock_portal();
+	~mock_portal();
+
+	skynet::portal_options options() const;
+
+	struct faults {
+		std::chrono::milliseconds latency; // before each reply
+		size_t bandwidth; // bytes per second each way per connection, 0 for no limit
+		double failure_rate; // fraction of requests answered with 503
+		double disconnect_rate; // fraction of replies cut off halfway through the body
+	};
+	void inject(faults const & faults);
+
+	std::atomic<unsigned long long> requests{0};
+	std::atomic<unsigned long long> bytes_received{0};
+	std::atomic<unsigned long long> bytes_sent{0};
+
+	struct file {
+		std::string contenttype;
+		std::vector<uint8_t> data;
+	};
+	struct skyfile {
+		std::string filename;
+		std::vector<std::pair<std::string, file>> subfiles; // concatenated in upload order, as portals do
+	};
+
+private:
+
+	void accept_connections();
+	void serve(int connection);
+	bool read_more(int connection, std::string & buffer);
+	bool receive(int connection, std::string & buffer, size_t size, faults const & limits);
+	bool send(int connection, char const * data, size_t size, faults const & limits);
+	bool reply(int connection, int status, std::string const & headers, char const * body, size_t size, bool send_body, faults const & limits);
+	bool reply_upload(int connection, std::string const & target, std::map<std::string, std::string> & headers, std::string const & body, faults const & limits);
+	bool reply_download(int connection, std::string const & target, std::map<std::string, std::string> & headers, bool head, faults const & limits);
+
+	int listener = -1;
+	unsigned short port = 0;
+	std::thread acceptor;
+
+	std::mutex mutex; // guards everything below
+	bool stopping = false;
+	faults injected = {std::chrono::milliseconds(0), 0, 0, 0};
+	std::map<std::string, std::shared_ptr<skyfile const>> skyfiles;
+	std::set<int> connections;
+	std::vector<std::thread> handlers;
+};
+
+} // namespace sia
@@ -8,7 +8,7 @@ void dump_response(sia::skynet::response & response, bool content);
 int main()
 {
 	sia::skynet_multiportal multiportal;
-	auto transfer = multiportal.begin_transfer(sia::skynet_multiportal::upload);
+	auto transfer = multiportal.begin_transfer(sia::skynet_multiportal::upload_kind);
 	sia::skynet portal(transfer.portal);
 	std::cout << "uploading to portal: " << portal.options.url << std::endl;
 
@@ -22,7 +22,7 @@ int main()
 
 	std::cout << "hello-folder: " << skylink << std::endl;
 
-	transfer = multiportal.begin_transfer(sia::skynet_multiportal::download);
+	transfer = multiportal.begin_transfer(sia::skynet_multiportal::download_kind);
 	portal.options = transfer.portal;
 	std::cout << "querying portal: " << portal.options.url << std::endl;
 
@@ -33,7 +33,7 @@ int main()
 
 	dump_response(response, true);
 
-	transfer = multiportal.begin_transfer(sia::skynet_multiportal::upload);
+	transfer = multiportal.begin_transfer(sia::skynet_multiportal::upload_kind);
 	portal.options = transfer.portal;
 
 	std::cout << "uploading to portal: " << portal.options.url << std::endl;
@@ -44,7 +44,7 @@ int main()
 	
 	std::cout << example_filename << ": " << skylink << std::endl;
 
-	transfer = multiportal.begin_transfer(sia::skynet_multiportal::download);
+	transfer = multiportal.begin_transfer(sia::skynet_multiportal::download_kind);
 
 	std::cout << "downloading from portal: " << portal.options.url << std::endl;
 	response = portal.download_file(example_filename + ".fromskynet", skylink);
@@ -1,13 +1,21 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-namespace cpr { class Session; }
 
 namespace sia {
 
+class skynet_cache;
+class skynet_multiportal;
+
 class skynet {
 public:
 	struct portal_options {
@@ -17,17 +25,60 @@ public:
 		std::string directoryFileFieldname;
 	};
 	static portal_options default_options();
+	// the known portals.  these come from memory, a local cache file, or a built-in list,
+	// and never from the network; a missing or stale cache is refreshed in the background.
 	static std::vector<portal_options> portals();
+	// fetch the portal list now, replacing the cached one
+	static std::vector<portal_options> refresh_portals(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	// where the portal list is cached and how long it is fresh for.  an empty path disables the file.
+	// defaults to $XDG_CACHE_HOME/siaskynetpp-portals.json or ~/.cache/siaskynetpp-portals.json, for a day.
+	// unless fallback is false, https://siasky.dev is added to a list that lacks it.
+	static void configure_portal_cache(std::string const & path, std::chrono::seconds ttl = std::chrono::hours(24), bool fallback = true);
 
 	struct upload_data {
 		std::string filename;
 		std::vector<uint8_t> data;
 		std::string contenttype;
 
+		// if span is set, content is sent from it instead of data, without copying
+		uint8_t const * span = nullptr;
+		size_t span_size = 0;
+		std::shared_ptr<void const> span_owner; // keeps a shared or mapped span alive
+
+		// if reader is set, content is pulled from it while sending.
+		// it fills up to size bytes of buffer and returns how many, 0 at the end.
+		std::function<size_t(uint8_t * buffer, size_t size)> reader;
+		size_t reader_size = unknown_size;
+		static constexpr size_t unknown_size = ~size_t(0);
+
 		template <typename Data>
 		upload_data(std::string filename, Data const & data, std::string contenttype = {})
 		: filename(filename), data(std::begin(data), std::end(data)), contenttype(contenttype)
 		{ }
+		upload_data(std::string filename, std::vector<uint8_t> && data, std::string contenttype = {})
+		: filename(filename), data(std::move(data)), contenttype(contenttype)
+		{ }
+
+		// refer to memory that must outlive the upload
+		static upload_data borrowed(std::string filename, uint8_t const * data, size_t size, std::string contenttype = {});
+		// share ownership of a buffer
+		static upload_data shared(std::string filename, std::shared_ptr<std::vector<uint8_t> const> data, std::string contenttype = {});
+		// memory-map a file, so it is paged in as it is sent
+		static upload_data mapped(std::string filename, std::string const & path, std::string contenttype = {});
+		// pull content from a callback; an unknown size sends the upload chunked
+		static upload_data streamed(std::string filename, std::function<size_t(uint8_t * buffer, size_t size)> reader, size_t size = unknown_size, std::string contenttype = {});
+	};
+
+	// how a request went, as curl measured it.  times are from the start of the request.
+	struct request_timing {
+		std::chrono::microseconds name_lookup{0};
+		std::chrono::microseconds connect{0};
+		std::chrono::microseconds app_connect{0}; // tls handshake done, 0 without tls
+		std::chrono::microseconds start_transfer{0}; // first byte of the reply
+		std::chrono::microseconds total{0}; // 0 if nothing was requested, as for a cache hit
+		unsigned long long bytes_sent = 0; // request body
+		unsigned long long bytes_received = 0; // reply body
+		std::string http_version; // "1.0", "1.1", "2" or "3"
 	};
 
 	struct response {
@@ -46,30 +97,115 @@ public:
 
 		std::vector<uint8_t> data;
 		std::vector<std::pair<size_t,size_t>> dataranges;
+
+		// of the request that answered; for segmented and vectored downloads, the first one
+		request_timing timing;
 	};
 
+	// thrown when a portal replies with an unexpected status
+	class http_error : public std::runtime_error {
+	public:
+		http_error(long status, std::string const & what)
+		: std::runtime_error(what), status(status)
+		{ }
+		long const status;
+	};
+
+	// receives body bytes as they arrive; throw to abort the transfer
+	using sink = std::function<void(uint8_t const * data, size_t size)>;
+	// receives body bytes along with their offset in the file, which may arrive out of order
+	using positional_sink = std::function<void(size_t offset, uint8_t const * data, size_t size)>;
+	// receives the reply's filename and metadata before its first body byte, so a sink can tell its subfiles apart
+	using start_callback = std::function<void(response const & headers)>;
+
 	skynet();
 	skynet(portal_options const & options);
 	~skynet();
 
 	portal_options options;
+	// if set, queries and blocking downloads are answered from here when they can be, and stored here when not.
+	// a hit is copied into response.data, except that a sink is handed the mapped bytes directly.
+	// the async_ calls neither read nor fill it.
+	std::shared_ptr<skynet_cache> cache;
+
+	// ranges are pairs of offset and length; a length of to_end reads the rest of the file
+	static constexpr size_t to_end = ~size_t(0);
 
 	response query(std::string const & skylink, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 	response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	// streaming downloads: the body is passed to output and response.data is left empty
+	response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, sink const & output, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, sink const & output, start_callback const & start, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, std::ostream & output, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, int fd, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 	response download_file(std::string const & path, std::string const & skylink, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 
+	// segmented downloads: the length is queried, then the file is fetched as parallel range
+	// requests written in place.  segments are spread round-robin across portals if given,
+	// and a failed segment is retried once on each other portal.
+	response download_segmented(std::string const & skylink, size_t segments, std::vector<portal_options> const & portals = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	response download_segmented(std::string const & skylink, size_t segments, positional_sink const & output, std::vector<portal_options> const & portals = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	response download_segmented_file(std::string const & path, std::string const & skylink, size_t segments, std::vector<portal_options> const & portals = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	static constexpr size_t min_segment_size = 256 * 1024;
+
+	// vectored reads: many buffers of one file are filled with as few range requests as possible.
+	// reads within gap bytes of each other share a range, and the bytes between them are dropped.
+	// at most max_ranges ranges (at least 1) go in one request; more are sent as concurrent requests.
+	struct read_request {
+		size_t offset;
+		size_t length;
+		uint8_t * buffer;
+	};
+	response download_vectored(std::string const & skylink, std::vector<read_request> const & reads, size_t gap = 4096, size_t max_ranges = 64, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+	// uploads fill in timing if it is given, even when the portal refuses them
 	template <typename Data>
-	std::string upload(std::string const & filename, Data const & data, std::string const & contenttype = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+	std::string upload(std::string const & filename, Data const & data, std::string const & contenttype = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr)
 	{
-		return upload(upload_data{filename, data, contenttype}, timeout);
+		return upload(upload_data{filename, data, contenttype}, timeout, timing);
 	}
-	std::string upload(upload_data && file, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
-	std::string upload(std::string const & filename, std::vector<upload_data> && files, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
-	std::string upload_file(std::string const & path, std::string filename = "", std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::string upload(upload_data && file, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr);
+	std::string upload(std::string const & filename, std::vector<upload_data> && files, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr);
+	std::string upload_file(std::string const & path, std::string filename = "", std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr);
 	//TODO: void upload_directory(std::string const & path, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 
+	// asynchronous transfers, all run together by one background thread.
+	// the portal options are copied when the transfer starts, so this object need not outlive it.
+	// futures hold the same results and exceptions as the blocking calls.
+	// an upload's timing is filled in before its future is ready.
+	std::future<response> async_query(std::string const & skylink, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<response> async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<response> async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges, sink output, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<std::string> async_upload(upload_data && file, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr);
+	std::future<std::string> async_upload(std::string const & filename, std::vector<upload_data> && files, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), request_timing * timing = nullptr);
+
+	// passed to asynchronous transfers so they can be abandoned; a cancelled transfer
+	// stops promptly and completes with an error
+	class cancellation {
+	public:
+		void cancel();
+		bool cancelled() const { return flag; }
+	private:
+		std::atomic<bool> flag{false};
+	};
+
+	// completion callbacks are called on the transfer thread, and should not block.
+	// exactly one of the result or error is set.
+	using response_callback = std::function<void(response * result, std::exception_ptr error)>;
+	using upload_callback = std::function<void(std::string const * skylink, std::exception_ptr error)>;
+	void async_query(std::string const & skylink, response_callback completion, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), std::shared_ptr<cancellation> cancel = {});
+	void async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges, sink output, response_callback completion, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), std::shared_ptr<cancellation> cancel = {});
+	void async_upload(upload_data && file, upload_callback completion, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), std::shared_ptr<cancellation> cancel = {}, request_timing * timing = nullptr);
+	void async_upload(std::string const & filename, std::vector<upload_data> && files, upload_callback completion, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), std::shared_ptr<cancellation> cancel = {}, request_timing * timing = nullptr);
+
 private:
-	 cpr::Session * session;
+	// multiportal resumes downloads from arbitrary ranges, blocking on the caller's thread
+	friend class skynet_multiportal;
+
+	response perform_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, sink const * output, std::chrono::milliseconds timeout, start_callback const * start = nullptr);
+	response download_segmented(std::string const & skylink, size_t segments, positional_sink const & output, std::vector<portal_options> const & portals, std::chrono::milliseconds timeout, std::vector<uint8_t> * buffer);
+	void submit_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, sink output, positional_sink positional, response_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel = {});
+	void submit_upload(std::vector<upload_data> && files, std::string const & filename, std::string const & field, upload_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel = {}, request_timing * timing = nullptr);
 };
 
 }
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "siaskynet.hpp"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace sia {
+
+// on-disk cache of downloads, keyed by skylink, path and range.
+// skylinks are immutable, so entries never go stale; the least recently used
+// are removed to stay within a byte budget.  hits are memory-mapped.
+class skynet_cache {
+public:
+	skynet_cache(std::string directory, size_t max_bytes = size_t(1) << 30);
+
+	struct entry {
+		skynet::response response; // everything but the data
+		uint8_t const * data = nullptr;
+		size_t size = 0;
+		std::shared_ptr<void const> mapping; // keeps data mapped
+	};
+
+	// key for a download of a skylink, which may include a path, and ranges
+	static std::string key(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges = {});
+
+	bool lookup(std::string const & key, entry & result);
+	void store(std::string const & key, skynet::response const & response, uint8_t const * data, size_t size);
+	// drop an entry, as one whose data was found to be wrong
+	void erase(std::string const & key);
+
+	// stores data as it streams in; nothing is stored unless commit is called
+	class writer {
+	public:
+		writer(skynet_cache & cache, std::string const & key);
+		~writer();
+		void append(uint8_t const * data, size_t size);
+		void commit(skynet::response const & response);
+	private:
+		skynet_cache & cache;
+		std::string key;
+		std::string path;
+		int fd;
+		size_t size;
+	};
+
+	size_t size();
+	void clear();
+
+	std::string const directory;
+	size_t const max_bytes;
+
+private:
+	struct item {
+		std::string name;
+		size_t size;
+	};
+	std::string name(std::string const & key);
+	void insert(std::string const & name, size_t size);
+	void evict();
+	void remove(std::string const & name);
+
+	std::mutex mutex;
+	size_t total = 0;
+	std::list<item> recent; // most recently used first
+	std::unordered_map<std::string, std::list<item>::iterator> items;
+};
+
+} // namespace sia
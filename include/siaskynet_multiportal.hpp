@@ -2,75 +2,264 @@
 
 #include "siaskynet.hpp"
 
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <thread>
 
 namespace sia {
 
 class skynet_multiportal {
 public:
 
-	skynet_multiportal(std::chrono::milliseconds timeout = std::chrono::milliseconds(10000), bool do_not_set_up_portals = false);
+	// if shared_metrics names a file, metrics are shared through it as by share_metrics,
+	// and the portals are not measured at startup when it already knows them.
+	skynet_multiportal(std::chrono::milliseconds timeout = std::chrono::milliseconds(10000), bool do_not_set_up_portals = false, unsigned slots_per_portal = 4, std::string const & shared_metrics = {});
+	~skynet_multiportal();
 
-	/*
+	// transfers over the best portal, moving on to the next best when one fails,
+	// until one succeeds, every portal has been tried, or the timeout passes.
+	// the timeout covers every attempt together.  metrics are recorded as they go.
+	// a download moved to another portal continues from the bytes already received.
+	// uploads from a reader are sent only once, as they cannot be replayed.
 	skynet::response query(std::string const & skylink, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 	skynet::response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	skynet::response download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, skynet::sink const & output, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 	skynet::response download_file(std::string const & path, std::string const & skylink, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 
 	template <typename Data>
-	std::string upload(std::string const & filename, Data const & data, std::string const & contenttype = {}, unsigned long parallelism = 1, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+	std::string upload(std::string const & filename, Data const & data, std::string const & contenttype = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
 	{
-		return upload(skynet::upload_data{filename, data, contenttype}, parallelism, timeout);
+		return upload(skynet::upload_data{filename, data, contenttype}, timeout);
 	}
-	std::string upload(skynet::upload_data const & file, unsigned long parallelism = 1, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
-	std::string upload(std::string const & filename, std::vector<upload_data> const & files, unsigned long parallelism = 1, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
-	std::string upload_file(std::string const & path, std::string filename = "", unsigned long parallelism = 1, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
-	*/
+	std::string upload(skynet::upload_data const & file, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::string upload(std::string const & filename, std::vector<skynet::upload_data> const & files, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::string upload_file(std::string const & path, std::string filename = "", std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
 	// only problem with multiportal-download is the user doesn't know what portal is being used before completion
 	// it would be nice to get an in-progress-transfer return value
 	// it seems this would go in a separate class, though
 
 	enum transfer_kind {
-		download = 0,
-		upload = 1,
+		download_kind = 0,
+		upload_kind = 1,
 		transfer_kind_count = 2
 	};
 
+	struct portal_metrics;
+
 	struct transfer {
 		transfer_kind kind;
 		skynet::portal_options portal;
 		std::chrono::steady_clock::time_point start_time;
+		portal_metrics * entry = nullptr; // the slot holder, set by begin_transfer
+		std::chrono::steady_clock::time_point first_byte_time = {}; // set by first_byte
 	};
 
-	// call when starting a transfer to select a portal and track metrics
+	// call when starting a transfer to select a portal and track metrics.
+	// each portal takes a limited number of transfers of each kind at once, and
+	// this waits if every portal is full.  free portals are picked at random,
+	// weighted toward the soonest expected completion: the time a transfer of
+	// the usual size would take, from its time to first byte and body rate,
+	// times its queue depth.  portals whose circuit is open are left out.
 	transfer begin_transfer(transfer_kind kind, skynet::portal_options portal = {});
 
-	// call when transfer is done to record metrics and reuse portal
+	// optionally call when data first arrives, to record time to first byte
+	void first_byte(transfer & transfer);
+
+	// call when transfer is done to record metrics and reuse portal.
+	// with the request's timing, its time to first byte and body rate come from curl.
 	void end_transfer(transfer, unsigned long amount_successfully_transferred);
+	void end_transfer(transfer, unsigned long amount_successfully_transferred, skynet::request_timing const & timing);
+	// or when it failed, or was abandoned in favor of another.
+	// a skynet::http_error in the 4xx class, besides 408 and 429, blames the request
+	// rather than the portal; anything else counts against the portal's circuit.
+	void fail_transfer(transfer, std::exception_ptr error = {});
+	void cancel_transfer(transfer);
+
+	// a portal's circuit opens after failure_threshold consecutive failures, and
+	// no transfers are sent to it.  after a back-off, one trial transfer is let
+	// through (half open): success closes the circuit, failure opens it again
+	// with double the back-off.
+	enum circuit_state {
+		circuit_closed = 0,
+		circuit_open = 1,
+		circuit_half_open = 2
+	};
+	struct circuit_options {
+		unsigned failure_threshold;
+		std::chrono::steady_clock::duration initial_backoff;
+		std::chrono::steady_clock::duration max_backoff;
+	};
+	circuit_options circuits = {
+		5,
+		std::chrono::seconds(1),
+		std::chrono::minutes(5)
+	};
+
+	// a histogram of durations on a logarithmic scale, in which older samples weigh less
+	struct decaying_histogram {
+		static constexpr size_t bucket_count = 96; // 100us to about 20 minutes, four per doubling
+		double buckets[bucket_count] = {};
+		double weight = 0;
+		void decay(double keep);
+		void add(std::chrono::steady_clock::duration sample);
+		// 0 if empty
+		std::chrono::steady_clock::duration quantile(double fraction) const;
+	};
+
+	struct shared_record; // a portal's entry in a shared metrics file
 
 	struct portal_metrics {
 		skynet::portal_options portal;
+		std::atomic<unsigned> slots{0}; // transfers of each kind allowed at once
 		struct metric {
-			double speed = 0;
-			unsigned long long data = 0;
-			std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration(0);
+			// bytes per second of bodies after their first byte, seconds to the first
+			// byte, and fraction of transfers succeeding, averaged so that each sample's
+			// weight halves every metric_half_life.  speed samples weigh their duration.
+			std::atomic<double> speed{0};
+			std::atomic<double> first_byte{0};
+			std::atomic<double> reliability{1};
+			std::atomic<unsigned> in_flight{0};
+			std::atomic<unsigned long long> data{0};
+			std::atomic<unsigned long long> successes{0};
+			std::atomic<unsigned long long> errors{0};
+			std::atomic<unsigned long long> cancellations{0};
+			// the rest is guarded by mutex
+			decaying_histogram time_to_first_byte;
+			decaying_histogram latency;
+			double speed_weight = 0;
+			double first_byte_weight = 0;
+			double reliability_weight = 0;
+			std::chrono::steady_clock::time_point last_sample = {};
 			std::mutex mutex;
 		} metrics[transfer_kind_count];
+
+		std::atomic<int> circuit{circuit_closed};
+		std::atomic<unsigned> consecutive_failures{0};
+		std::atomic<std::chrono::steady_clock::rep> retry_time{0}; // when an open circuit may be tried
+		std::chrono::steady_clock::duration backoff = {};
+
+		std::atomic<shared_record *> shared{nullptr}; // set by share_metrics
+
+		std::mutex mutex; // guards portal and backoff
 	};
 
+	// how quickly old samples stop counting
+	std::chrono::steady_clock::duration metric_half_life = std::chrono::minutes(10);
+
+	// every portal's metrics, for dashboards
+	std::string metrics_json();
+	std::string metrics_prometheus();
+
+	// metrics as json, to be passed to restore_metrics in a later run or another process.
+	// restored samples count as if taken when saved, so they fade with metric_half_life.
+	// portals in the snapshot are added if missing.
+	std::string save_metrics();
+	void restore_metrics(std::string const & saved);
+
+	// share metrics with other processes on the host through a memory-mapped file,
+	// created if missing.  each portal starts from what the file knows, and every
+	// finished transfer is folded into the file with lock-free atomic updates.
+	// returns whether the file knew the speed of some portal for both kinds.
+	bool share_metrics(std::string const & path);
+
 	// add a portal to the list, or update its options
 	void ensure_portal(skynet::portal_options portal);
 
-	// transfer a little data over all the portals to get metrics, returns if any succeeded
+	// how many transfers of each kind a portal takes at once
+	void set_portal_slots(std::string const & url, unsigned slots);
+	unsigned const slots_per_portal;
+
+	// transfer a little data over all the portals to get metrics.  returns once an upload
+	// and a download have succeeded, or false at the timeout; the rest continue in the background.
 	bool measure_portals(std::chrono::milliseconds timeout = std::chrono::milliseconds(10000));
 
+	// portals are measured by a few background workers, again every interval.
+	// each probe uploads random data of each size and downloads it back.
+	// a busy portal is skipped, as its real transfers are measured anyway.
+	struct probe_options {
+		unsigned workers;
+		std::vector<size_t> sizes;
+		std::chrono::milliseconds interval; // 0 to measure only when asked
+		std::chrono::milliseconds timeout; // per transfer
+	};
+	probe_options probes = {
+		4,
+		{1024, 256 * 1024},
+		std::chrono::minutes(10),
+		std::chrono::seconds(30)
+	};
+	// (re)start the workers with the current probes options
+	void start_probes();
+	// cancel probes in progress and join the workers
+	void stop_probes();
+
 	// get metrics for a portal by url
 	portal_metrics const & metrics(std::string url);
 
+	// up to count portals, fastest first, e.g. to spread a segmented download across
+	std::vector<skynet::portal_options> ranked_portals(transfer_kind kind, size_t count);
+
+	// hedged download: starts on the best portal, and if no data has arrived after
+	// hedge_delay, starts again on the next best free one.  the first to finish is
+	// returned and the other cancelled; both are recorded in the metrics.
+	// a failure before the delay starts the second right away.
+	// a zero delay uses the first portal's 95th percentile time to first byte.
+	skynet::response download_hedged(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges = {}, std::chrono::milliseconds hedge_delay = std::chrono::milliseconds(0), std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
 private:
+	// pick a portal with a free slot and take the slot, or return null.  locked if the caller holds mutex.
+	portal_metrics * select_portal(transfer_kind kind, std::vector<portal_metrics const *> const & exclude = {}, bool locked = false);
+	// select_portal, waiting for a slot until the deadline; false if none
+	bool acquire_transfer(transfer_kind kind, std::vector<portal_metrics const *> const & exclude, std::chrono::steady_clock::time_point deadline, transfer & result);
+	// the retry loop of the high-level transfers; attempt returns the amount transferred or throws.
+	// throwing abort_failover ends the loop with its error, without blaming the portal.
+	struct abort_failover { std::exception_ptr error; };
+	// it may fill in timing from the request that succeeded.
+	void failover(transfer_kind kind, std::chrono::milliseconds timeout, size_t max_attempts, std::function<unsigned long(transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing)> attempt);
+	bool reserve_slot(portal_metrics & portal, transfer_kind kind);
+	// free a slot and wake those waiting for one
+	void release_slot(portal_metrics & portal, transfer_kind kind, bool locked = false);
+	transfer start_transfer(transfer_kind kind, portal_metrics & portal);
+	enum outcome { succeeded, failed, rejected, cancelled };
+	bool admit(portal_metrics & portal);
+	void record_circuit(portal_metrics & portal, outcome result);
+	void finish_transfer(transfer const & transfer, outcome result, unsigned long amount, skynet::request_timing const * timing = nullptr);
+	// call with the metric's mutex held
+	void age_metric(portal_metrics::metric & metric, std::chrono::steady_clock::time_point now);
+	void merge_metric(portal_metrics::metric & metric, double speed, double speed_weight, double first_byte, double first_byte_weight, double reliability, double reliability_weight, std::chrono::steady_clock::duration age);
+	// seconds a transfer of typical_size would take, filling in unknown figures with the given
+	double expected_seconds(portal_metrics::metric const & metric, transfer_kind kind, double unknown_first_byte, double unknown_speed);
+	void unknown_estimates(std::vector<portal_metrics *> const & portals, transfer_kind kind, double & first_byte, double & speed);
+	// find or claim the portal's shared record and merge what it knows; returns which kinds it knew
+	unsigned attach_shared(portal_metrics & portal, std::string const & url);
+
+	void probe_worker();
+	void queue_probe_round();
+	void probe(portal_metrics & portal);
+
+	std::mutex probe_mutex;
+	std::condition_variable probe_changed;
+	std::vector<std::thread> probe_threads;
+	std::deque<portal_metrics *> probe_queue;
+	std::set<portal_metrics *> probing; // not queued again until done
+	std::set<std::shared_ptr<skynet::cancellation>> probe_transfers;
+	std::chrono::steady_clock::time_point next_probe_round;
+	bool probes_stopping = false;
+	unsigned long probe_successes[transfer_kind_count] = {};
+
+	// taken to add portals and to wait for a slot, never to pick one
 	std::mutex mutex;
 	std::condition_variable transferred[transfer_kind_count];
+	std::atomic<unsigned> waiting[transfer_kind_count] = {};
+
+	// a moving average of successful transfer sizes, to weigh time to first byte against speed
+	std::atomic<double> typical_size[transfer_kind_count] = {};
 
 	// note:
 	// 	siaskynet_multiportal.cpp uses element pointers while mutex is
@@ -78,6 +267,12 @@ private:
 	// 	pointers) are valid across insertion. (std::unordered_map does
 	// 	not, so do not use it here)
 	std::map<std::string, portal_metrics> portals;
+	// the portals as of the last insertion, read without the mutex by std::atomic_load
+	std::shared_ptr<std::vector<portal_metrics *> const> snapshot = std::make_shared<std::vector<portal_metrics *>>();
+
+	// the file mapped by share_metrics, set under mutex
+	void * shared_mapping = nullptr;
+	size_t shared_size = 0;
 };
 
 } // namespace sia
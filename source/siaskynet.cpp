@@ -1,20 +1,206 @@
 #include <siaskynet.hpp>
+#include <siaskynet_cache.hpp>
 
-#include <cpr/cpr.h>
+#include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace sia {
 
+struct header_less
+{
+	bool operator()(std::string const & left, std::string const & right) const
+	{
+		return strcasecmp(left.c_str(), right.c_str()) < 0;
+	}
+};
+using header_map = std::map<std::string, std::string, header_less>;
+
+// read position within one multipart part
+struct part_cursor
+{
+	skynet::upload_data const * file;
+	size_t offset;
+	std::exception_ptr * exception; // where a throwing reader's exception is kept
+};
+
+// process-wide cache of curl handles per portal.  the handles of a portal share
+// one set of dns, tls session and connection caches, so connections made by
+// any skynet object are kept alive and reused by all the others.
+class connection_pool
+{
+public:
+	static connection_pool & instance();
+	~connection_pool();
+
+	// returns a handle configured for the portal, with no request options set
+	CURL * acquire(std::string const & portal_url);
+	void release(std::string const & portal_url, CURL * handle);
+
+	static constexpr size_t max_idle_handles = 16;
+	static constexpr long dns_cache_seconds = 600;
+
+private:
+	connection_pool() = default;
+
+	struct portal_entry
+	{
+		CURLSH * share;
+		std::mutex locks[CURL_LOCK_DATA_LAST];
+		std::vector<CURL *> idle;
+	};
+	void configure(CURL * handle, portal_entry & portal);
+	static void lock(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr);
+	static void unlock(CURL * handle, curl_lock_data data, void * userptr);
+
+	std::mutex mutex;
+	std::map<std::string, std::unique_ptr<portal_entry>> portals;
+};
+
+// the known portals, loaded once per process from a local cache file and
+// refreshed in the background when the file is missing or older than its ttl
+class portal_registry
+{
+public:
+	static portal_registry & instance();
+
+	std::vector<skynet::portal_options> portals();
+	std::vector<skynet::portal_options> refresh(std::chrono::milliseconds timeout);
+	void configure(std::string const & path, std::chrono::seconds ttl, bool fallback);
+
+private:
+	portal_registry();
+	void load();
+	void start_refresh();
+	void store(std::string const & text);
+	static std::vector<skynet::portal_options> parse(std::string const & text, bool fallback);
+
+	static std::string const list_url;
+	static std::string const builtin_list;
+
+	std::mutex mutex;
+	std::string path;
+	std::chrono::seconds ttl;
+	bool fallback = true; // whether the default portal is added to lists that lack it
+	bool loaded = false;
+	bool refreshing = false;
+	std::vector<skynet::portal_options> list;
+};
+
+// state of a single libcurl request, passed to the callbacks as userdata
+struct curl_request
+{
+	curl_request(std::string const & portal_url)
+	: portal_url(portal_url), handle(connection_pool::instance().acquire(portal_url))
+	{ }
+	~curl_request()
+	{
+		connection_pool::instance().release(portal_url, handle);
+	}
+	curl_request(curl_request const &) = delete;
+	curl_request & operator=(curl_request const &) = delete;
+
+	std::string portal_url;
+	CURL * handle;
+	skynet::sink const * output = nullptr; // success bodies go here if set, otherwise into body
+	skynet::positional_sink const * positional = nullptr; // or here, with their offsets in the file
+	std::vector<std::pair<size_t, size_t>> ranges; // a 200 reply to a range request is refused rather than streamed
+	std::vector<std::pair<size_t, size_t>> received_ranges; // as reported by the reply's content-range
+	// the parts of a range reply, split as they stream in
+	struct {
+		bool started = false;
+		bool closed = false;
+		std::string boundary; // empty unless the reply is multipart/byteranges
+		std::string header; // text between parts, buffered until complete
+		size_t remaining = 0; // body bytes left in the current part
+		size_t position = 0; // file offset of the next body byte
+	} parts;
+	std::unique_ptr<curl_mime, decltype(&curl_mime_free)> mime{nullptr, curl_mime_free};
+	std::vector<part_cursor> cursors;
+	long status_code = 0;
+	header_map header;
+	std::vector<uint8_t> body;
+	std::exception_ptr exception;
+	char error[CURL_ERROR_SIZE];
+};
+
+// a request run by the transfer engine, owning everything the request refers to
+struct async_request
+{
+	curl_request request;
+	std::vector<skynet::upload_data> files;
+	skynet::sink output;
+	skynet::positional_sink positional;
+	std::shared_ptr<skynet::cancellation> cancel;
+	std::function<void(async_request &, CURLcode)> complete;
+
+	async_request(std::string const & portal_url)
+	: request(portal_url)
+	{ }
+};
+
+// runs every asynchronous request in the process on one thread over a curl multi handle
+class transfer_engine
+{
+public:
+	static transfer_engine & instance();
+	~transfer_engine();
+
+	void submit(std::unique_ptr<async_request> request);
+	// look for cancelled requests
+	void wake_cancelled();
+
+private:
+	transfer_engine();
+	void run();
 
-static void read_file(std::string const & path, std::vector<uint8_t> & buffer);
-static void write_file(std::string const & path, std::vector<uint8_t> const & buffer);
-static std::string uploadToField(std::vector<skynet::upload_data> && files, std::string const & filename, cpr::Session *, std::string const & field, std::chrono::milliseconds timeout);
+	CURLM * multi;
+	std::mutex mutex;
+	bool stopping = false;
+	bool cancelling = false;
+	std::vector<std::unique_ptr<async_request>> pending;
+	std::map<CURL *, std::unique_ptr<async_request>> active;
+	std::thread thread;
+};
+
+static void initCurl();
+static void prepareRequest(curl_request & request, std::string const & url, std::chrono::milliseconds timeout);
+static void performRequest(curl_request & request);
+static void checkRequest(curl_request & request, CURLcode code);
+static void prepareQuery(curl_request & request, std::string const & url, std::chrono::milliseconds timeout);
+static void prepareDownload(curl_request & request, std::string const & url, std::vector<std::pair<size_t, size_t>> const & ranges, std::chrono::milliseconds timeout);
+static void prepareUpload(curl_request & request, std::vector<skynet::upload_data> const & files, std::string const & filename, std::string const & url, std::string const & field, std::chrono::milliseconds timeout);
+static skynet::response headerResponse(curl_request & request, std::string const & skylink, skynet::portal_options const & portal);
+static skynet::response finishQuery(curl_request & request, std::string const & skylink, skynet::portal_options const & portal);
+static skynet::response finishDownload(curl_request & request, std::string const & skylink, skynet::portal_options const & portal);
+static std::string finishUpload(curl_request & request, skynet::request_timing * timing);
+static skynet::request_timing requestTiming(CURL * handle);
+static size_t receiveHeader(char * data, size_t size, size_t count, void * userdata);
+static size_t receiveBody(char * data, size_t size, size_t count, void * userdata);
+static void receiveRanges(curl_request & request, uint8_t const * data, size_t size);
+static void deliverBody(curl_request & request, uint8_t const * data, size_t size);
+static bool parseContentRange(std::string const & content_range, size_t & start, size_t & length);
+static size_t sendPart(char * buffer, size_t size, size_t count, void * userdata);
+static int seekPart(void * userdata, curl_off_t offset, int origin);
 static std::string trimSiaPrefix(std::string const & skylink);
 static std::string trimTrailingSlash(std::string const & url);
-static skynet::response::subfile parseCprResponse(cpr::Response & response);
+static std::string trimLeadingSlash(std::string const & url);
+static skynet::response::subfile parseMetadataHeaders(header_map & header);
 static std::string extractContentDispositionFilename(std::string const & content_disposition);
 static skynet::response::subfile parse_subfile(size_t & offset, nlohmann::json const & value);
 
@@ -25,18 +211,152 @@ skynet::portal_options skynet::default_options()
 
 std::vector<skynet::portal_options> skynet::portals()
 {
-	std::unordered_set<std::string> urls;
-	std::vector<skynet::portal_options> result;
-	auto response = cpr::Get(cpr::Url{"https://siastats.info/dbs/skynet_current.json"});
+	return portal_registry::instance().portals();
+}
+
+std::vector<skynet::portal_options> skynet::refresh_portals(std::chrono::milliseconds timeout)
+{
+	return portal_registry::instance().refresh(timeout);
+}
+
+void skynet::configure_portal_cache(std::string const & path, std::chrono::seconds ttl, bool fallback)
+{
+	portal_registry::instance().configure(path, ttl, fallback);
+}
+
+portal_registry & portal_registry::instance()
+{
+	static portal_registry registry;
+	return registry;
+}
+
+portal_registry::portal_registry()
+: ttl(std::chrono::hours(24))
+{
+	char const * cache_home = getenv("XDG_CACHE_HOME");
+	char const * home = getenv("HOME");
+	std::string directory;
+	if (cache_home && cache_home[0]) {
+		directory = cache_home;
+	} else if (home && home[0]) {
+		directory = std::string(home) + "/.cache";
+	}
+	if (directory.size()) {
+		path = directory + "/siaskynetpp-portals.json";
+	}
+}
+
+void portal_registry::configure(std::string const & path, std::chrono::seconds ttl, bool fallback)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->path = path;
+	this->ttl = ttl;
+	this->fallback = fallback;
+	loaded = false;
+}
+
+std::vector<skynet::portal_options> portal_registry::portals()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!loaded) {
+		load();
+	}
+	return list;
+}
+
+std::vector<skynet::portal_options> portal_registry::refresh(std::chrono::milliseconds timeout)
+{
+	curl_request request(list_url);
+	prepareRequest(request, list_url, timeout);
+	performRequest(request);
+	if (request.status_code != 200) {
+		throw std::runtime_error("Portal list request failed with status code " + std::to_string(request.status_code));
+	}
+	std::string text(request.body.begin(), request.body.end());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto result = parse(text, fallback);
+	list = result;
+	loaded = true;
+	store(text);
+	return result;
+}
+
+void portal_registry::load()
+{
+	// called with the mutex held
 	std::string text;
-	if (response.error || response.status_code != 200) {
-		// retrieved 2020-05-14
-		text = R"([{"name":"SiaSky.net","files":[392823,7449,382702,5609],"size":[2.55,0.11,2.3,0.09],"link":"https://siasky.net","chartColor":"#666","version":"1.4.8-master","gitrevision":"a54efe103"},{"name":"SiaCDN.com","files":[659977],"size":[2.65],"link":"https://www.siacdn.com","chartColor":"#666","version":"1.4.8-master","gitrevision":"d47625aac"},{"name":"SkynetHub.io","files":[5408,0],"size":[0.04,0],"link":"https://skynethub.io","chartColor":"#666","version":"1.4.8-master","gitrevision":"ca21c97fc"},{"name":"SiaLoop.net","files":[40979],"size":[0.18],"link":"https://sialoop.net","chartColor":"#666","version":"1.4.7","gitrevision":"000eccb45"},{"name":"SkyDrain.net","files":[42242,914],"size":[0.23,0.04],"link":"https://skydrain.net","chartColor":"#666","version":"1.4.8","gitrevision":"1eb685ba8"},{"name":"Tutemwesi.com","files":[73918],"size":[0.32],"link":"https://skynet.tutemwesi.com","chartColor":"#666","version":"1.4.6-master","gitrevision":"c2a4d83"},{"name":"Luxor.tech","files":[21754],"size":[0.11],"link":"https://skynet.luxor.tech","chartColor":"#666","version":"1.4.5-master","gitrevision":"e1b995f"},{"name":"LightspeedHosting.com","files":[0],"size":[0],"link":"https://vault.lightspeedhosting.com","chartColor":"#666","version":"","gitrevision":""},{"name":"UTXO.no","files":[0],"size":[0],"link":"https://skynet.utxo.no","chartColor":"#666","version":"","gitrevision":""},{"name":"SkyPortal.xyz","files":[22858,0],"size":[0.14,0],"link":"https://skyportal.xyz","chartColor":"#666","version":"1.4.8","gitrevision":"1eb685ba8"}])";
-	} else {
-		text = response.text;
+	bool stale = true;
+	if (path.size()) {
+		std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+		struct stat status;
+		if (file.is_open() && stat(path.c_str(), &status) == 0) {
+			text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			stale = std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(status.st_mtime) > ttl;
+		}
+	}
+	try {
+		list = parse(text, fallback);
+	} catch (std::exception const &) {
+		list = parse(builtin_list, fallback);
+		stale = true;
+	}
+	loaded = true;
+
+	if (stale && !refreshing) {
+		start_refresh();
+	}
+}
+
+void portal_registry::start_refresh()
+{
+	// called with the mutex held
+	refreshing = true;
+	std::unique_ptr<async_request> state(new async_request(list_url));
+	prepareRequest(state->request, list_url, std::chrono::seconds(30));
+	state->complete = [this](async_request & state, CURLcode code) {
+		std::lock_guard<std::mutex> lock(mutex);
+		refreshing = false;
+		if (code != CURLE_OK || state.request.status_code != 200) { return; }
+		std::string text(state.request.body.begin(), state.request.body.end());
+		try {
+			list = parse(text, fallback);
+		} catch (std::exception const &) {
+			return;
+		}
+		store(text);
+	};
+	transfer_engine::instance().submit(std::move(state));
+}
+
+void portal_registry::store(std::string const & text)
+{
+	// called with the mutex held
+	if (!path.size()) { return; }
+
+	auto slash = path.rfind('/');
+	if (slash != std::string::npos && slash > 0) {
+		mkdir(path.substr(0, slash).c_str(), 0755);
 	}
+
+	// written aside and renamed, so other processes never read a partial list
+	std::string temporary = path + "." + std::to_string(getpid());
+	{
+		std::ofstream file(temporary.c_str(), std::ios::out | std::ios::binary);
+		file.write(text.data(), text.size());
+		if (!file.is_open() || file.fail()) { return; }
+	}
+	if (rename(temporary.c_str(), path.c_str()) != 0) {
+		unlink(temporary.c_str());
+	}
+}
+
+std::vector<skynet::portal_options> portal_registry::parse(std::string const & text, bool fallback)
+{
+	std::unordered_set<std::string> urls;
+	std::vector<skynet::portal_options> result;
 	for (auto portal : nlohmann::json::parse(text)) {
-		result.emplace_back(portal_options{
+		result.emplace_back(skynet::portal_options{
 			url: portal["link"],
 			uploadPath: "/skynet/skyfile",
 			fileFieldname: "file",
@@ -44,8 +364,8 @@ std::vector<skynet::portal_options> skynet::portals()
 		});
 		urls.insert(result.back().url);
 	}
-	if (!urls.count("https://siasky.dev")) {
-		result.emplace_back(portal_options{
+	if (fallback && !urls.count("https://siasky.dev")) {
+		result.emplace_back(skynet::portal_options{
 			url: "https://siasky.dev",
 			uploadPath: "/skynet/skyfile",
 			fileFieldname: "file",
@@ -56,19 +376,76 @@ std::vector<skynet::portal_options> skynet::portals()
 	return result;
 }
 
+std::string const portal_registry::list_url = "https://siastats.info/dbs/skynet_current.json";
+
+// retrieved 2020-05-14
+std::string const portal_registry::builtin_list = R"([{"name":"SiaSky.net","files":[392823,7449,382702,5609],"size":[2.55,0.11,2.3,0.09],"link":"https://siasky.net","chartColor":"#666","version":"1.4.8-master","gitrevision":"a54efe103"},{"name":"SiaCDN.com","files":[659977],"size":[2.65],"link":"https://www.siacdn.com","chartColor":"#666","version":"1.4.8-master","gitrevision":"d47625aac"},{"name":"SkynetHub.io","files":[5408,0],"size":[0.04,0],"link":"https://skynethub.io","chartColor":"#666","version":"1.4.8-master","gitrevision":"ca21c97fc"},{"name":"SiaLoop.net","files":[40979],"size":[0.18],"link":"https://sialoop.net","chartColor":"#666","version":"1.4.7","gitrevision":"000eccb45"},{"name":"SkyDrain.net","files":[42242,914],"size":[0.23,0.04],"link":"https://skydrain.net","chartColor":"#666","version":"1.4.8","gitrevision":"1eb685ba8"},{"name":"Tutemwesi.com","files":[73918],"size":[0.32],"link":"https://skynet.tutemwesi.com","chartColor":"#666","version":"1.4.6-master","gitrevision":"c2a4d83"},{"name":"Luxor.tech","files":[21754],"size":[0.11],"link":"https://skynet.luxor.tech","chartColor":"#666","version":"1.4.5-master","gitrevision":"e1b995f"},{"name":"LightspeedHosting.com","files":[0],"size":[0],"link":"https://vault.lightspeedhosting.com","chartColor":"#666","version":"","gitrevision":""},{"name":"UTXO.no","files":[0],"size":[0],"link":"https://skynet.utxo.no","chartColor":"#666","version":"","gitrevision":""},{"name":"SkyPortal.xyz","files":[22858,0],"size":[0.14,0],"link":"https://skyportal.xyz","chartColor":"#666","version":"1.4.8","gitrevision":"1eb685ba8"}])";
+
 skynet::skynet()
-: options(default_options()),
-  session(new cpr::Session())
+: options(default_options())
 { }
 
 skynet::skynet(skynet::portal_options const & options)
-: options(options),
-  session(new cpr::Session())
+: options(options)
 { }
 
 skynet::~skynet()
+{ }
+
+skynet::upload_data skynet::upload_data::borrowed(std::string filename, uint8_t const * data, size_t size, std::string contenttype)
 {
-	delete session;
+	upload_data result(filename, std::vector<uint8_t>(), contenttype);
+	result.span = data;
+	result.span_size = size;
+	return result;
+}
+
+skynet::upload_data skynet::upload_data::shared(std::string filename, std::shared_ptr<std::vector<uint8_t> const> data, std::string contenttype)
+{
+	upload_data result(filename, std::vector<uint8_t>(), contenttype);
+	result.span = data->data();
+	result.span_size = data->size();
+	result.span_owner = data;
+	return result;
+}
+
+skynet::upload_data skynet::upload_data::mapped(std::string filename, std::string const & path, std::string contenttype)
+{
+	upload_data result(filename, std::vector<uint8_t>(), contenttype);
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) { throw std::runtime_error("Failed to open " + path); }
+
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		close(fd);
+		throw std::runtime_error("Failed to stat " + path);
+	}
+	size_t size = status.st_size;
+	if (!size) {
+		close(fd);
+		return result;
+	}
+
+	void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) { throw std::runtime_error("Failed to map " + path); }
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	result.span = (uint8_t const *)mapping;
+	result.span_size = size;
+	result.span_owner = std::shared_ptr<void const>(mapping, [size](void const * mapping) {
+		munmap((void *)mapping, size);
+	});
+	return result;
+}
+
+skynet::upload_data skynet::upload_data::streamed(std::string filename, std::function<size_t(uint8_t * buffer, size_t size)> reader, size_t size, std::string contenttype)
+{
+	upload_data result(filename, std::vector<uint8_t>(), contenttype);
+	result.reader = reader;
+	result.reader_size = size;
+	return result;
 }
 
 std::string trimSiaPrefix(std::string const & skylink)
@@ -98,16 +475,13 @@ std::string trimLeadingSlash(std::string const & url)
 	}
 }
 
-std::string skynet::upload_file(std::string const & path, std::string filename, std::chrono::milliseconds timeout)
+std::string skynet::upload_file(std::string const & path, std::string filename, std::chrono::milliseconds timeout, request_timing * timing)
 {
 	if (!filename.size()) {
 		filename = path;
 	}
 
-	upload_data data(filename, std::vector<uint8_t>());
-	read_file(path, data.data);
-
-	return upload(std::forward<upload_data>(data), timeout);
+	return upload(upload_data::mapped(filename, path), timeout, timing);
 }
 
 /*
@@ -119,133 +493,697 @@ void skynet::upload_directory(std::string const & path, std::string const & file
 }
 */
 
-std::string skynet::upload(upload_data && file, std::chrono::milliseconds timeout)
+std::string skynet::upload(upload_data && file, std::chrono::milliseconds timeout, request_timing * timing)
 {
-	session->SetUrl(cpr::Url{trimTrailingSlash(options.url) + "/" + trimLeadingSlash(trimTrailingSlash(options.uploadPath))});
+	std::vector<upload_data> files;
+	files.emplace_back(std::move(file));
 
-	return uploadToField({file}, file.filename, session, options.fileFieldname, timeout);
+	curl_request request(options.url);
+	prepareUpload(request, files, files.back().filename, trimTrailingSlash(options.url) + "/" + trimLeadingSlash(trimTrailingSlash(options.uploadPath)), options.fileFieldname, timeout);
+	performRequest(request);
+
+	return finishUpload(request, timing);
 }
 
-std::string skynet::upload(std::string const & filename, std::vector<skynet::upload_data> && files, std::chrono::milliseconds timeout)
+std::string skynet::upload(std::string const & filename, std::vector<skynet::upload_data> && files, std::chrono::milliseconds timeout, request_timing * timing)
 {
-	session->SetUrl(cpr::Url{trimTrailingSlash(options.url) + "/" + trimLeadingSlash(trimTrailingSlash(options.uploadPath))});
+	curl_request request(options.url);
+	prepareUpload(request, files, filename, trimTrailingSlash(options.url) + "/" + trimLeadingSlash(trimTrailingSlash(options.uploadPath)), options.directoryFileFieldname, timeout);
+	performRequest(request);
 
-	return uploadToField(std::forward<std::vector<skynet::upload_data>>(files), filename, session, options.directoryFileFieldname, timeout);
+	return finishUpload(request, timing);
 }
 
-std::string uploadToField(std::vector<skynet::upload_data> && files, std::string const & filename, cpr::Session * session, std::string const & field, std::chrono::milliseconds timeout)
+skynet::response skynet::query(std::string const & skylink, std::chrono::milliseconds timeout)
 {
-	session->SetParameters({{"filename", filename}});
+	// a whole download has the same metadata as a query
+	std::string whole_key, query_key;
+	if (cache) {
+		whole_key = skynet_cache::key(skylink);
+		query_key = whole_key + " query";
+		skynet_cache::entry hit;
+		if (cache->lookup(whole_key, hit) || cache->lookup(query_key, hit)) {
+			hit.response.portal = options;
+			return hit.response;
+		}
+	}
 
-	cpr::Multipart uploads{};
+	curl_request request(options.url);
+	prepareQuery(request, trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink) + "?format=concat", timeout);
+	performRequest(request);
 
-	for (auto & file : files) {
-		uploads.parts.emplace_back(field, cpr::Buffer(file.data.begin(), file.data.end(), std::forward<std::string>(file.filename)), file.contenttype);
+	response result = finishQuery(request, skylink, options);
+	if (cache) {
+		try {
+			cache->store(query_key, result, nullptr, 0);
+		} catch (std::runtime_error const &) { } // an unwritable cache is only a slower one
 	}
+	return result;
+}
+
+skynet::response skynet::download_file(std::string const & path, std::string const & skylink, std::chrono::milliseconds timeout)
+{ 
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
 
-	session->SetMultipart(uploads);
-	session->SetTimeout(timeout);
-	auto response = session->Post();
-	session->SetMultipart({});
+	if (!file.is_open()) { throw std::runtime_error("Failed to open " + path); }
+
+	response result = download(skylink, {}, file, timeout);
+
+	file.close();
+
+	if (file.fail()) { throw std::runtime_error("Failed to write contents of " + path); }
+
+	return result;
+}
 
-	if (response.error) {
-		throw std::runtime_error(response.error.message);
-	} else if (response.status_code != 200) {
-		throw std::runtime_error(response.text);
+skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, std::chrono::milliseconds timeout)
+{
+	return perform_download(skylink, ranges, nullptr, timeout);
+}
+
+skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, sink const & output, std::chrono::milliseconds timeout)
+{
+	return perform_download(skylink, ranges, &output, timeout);
+}
+
+skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, sink const & output, start_callback const & start, std::chrono::milliseconds timeout)
+{
+	return perform_download(skylink, ranges, &output, timeout, &start);
+}
+
+skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, std::ostream & output, std::chrono::milliseconds timeout)
+{
+	sink stream_output = [&output](uint8_t const * data, size_t size) {
+		output.write((char const *)data, size);
+		if (output.fail()) { throw std::runtime_error("Failed to write to output stream"); }
+	};
+	return perform_download(skylink, ranges, &stream_output, timeout);
+}
+
+skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, int fd, std::chrono::milliseconds timeout)
+{
+	sink fd_output = [fd](uint8_t const * data, size_t size) {
+		while (size) {
+			ssize_t written = write(fd, data, size);
+			if (written < 0) {
+				if (errno == EINTR) { continue; }
+				throw std::runtime_error(std::string("Failed to write to file descriptor: ") + strerror(errno));
+			}
+			data += written;
+			size -= written;
+		}
+	};
+	return perform_download(skylink, ranges, &fd_output, timeout);
+}
+
+skynet::response skynet::perform_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, sink const * output, std::chrono::milliseconds timeout, start_callback const * start)
+{
+	// the headers are complete once the first body byte arrives
+	bool started = false;
+	curl_request * current = nullptr;
+	sink starting;
+	if (start && output) {
+		starting = [&, output](uint8_t const * data, size_t size) {
+			if (!started) {
+				started = true;
+				(*start)(headerResponse(*current, skylink, options));
+			}
+			(*output)(data, size);
+		};
+		output = &starting;
 	}
-	
-	auto json = nlohmann::json::parse(response.text);
+	auto finish = [&](curl_request & request) {
+		response result = finishDownload(request, skylink, options);
+		if (start && !started) {
+			started = true;
+			(*start)(result);
+		}
+		return result;
+	};
 
-	std::string skylink = "sia://" + json["skylink"].get<std::string>();
+	if (!cache) {
+		curl_request request(options.url);
+		current = &request;
+		request.output = output;
+		prepareDownload(request, trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink) + "?format=concat", ranges, timeout);
+		performRequest(request);
 
-	return skylink;
+		return finish(request);
+	}
+
+	std::string key = skynet_cache::key(skylink, ranges);
+	skynet_cache::entry hit;
+	if (cache->lookup(key, hit)) {
+		hit.response.portal = options;
+		if (start) {
+			started = true;
+			(*start)(hit.response);
+		}
+		if (output) {
+			(*output)(hit.data, hit.size);
+		} else {
+			hit.response.data.assign(hit.data, hit.data + hit.size);
+		}
+		return hit.response;
+	}
+
+	// streamed bodies are copied to the cache as they pass.  failing to write the
+	// cache abandons the entry, and never the download.
+	std::unique_ptr<skynet_cache::writer> pending;
+	sink tee;
+	curl_request request(options.url);
+	current = &request;
+	if (output) {
+		try {
+			pending.reset(new skynet_cache::writer(*cache, key));
+		} catch (std::runtime_error const &) { }
+		tee = [&pending, output](uint8_t const * data, size_t size) {
+			if (pending) {
+				try {
+					pending->append(data, size);
+				} catch (std::runtime_error const &) {
+					pending.reset();
+				}
+			}
+			(*output)(data, size);
+		};
+		request.output = &tee;
+	}
+	prepareDownload(request, trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink) + "?format=concat", ranges, timeout);
+	performRequest(request);
+
+	response result = finish(request);
+	try {
+		if (pending) {
+			pending->commit(result);
+		} else if (!output) {
+			cache->store(key, result, result.data.data(), result.data.size());
+		}
+	} catch (std::runtime_error const &) { }
+	return result;
 }
 
-skynet::response skynet::query(std::string const & skylink, std::chrono::milliseconds timeout)
+skynet::response skynet::download_segmented(std::string const & skylink, size_t segments, std::vector<portal_options> const & portals, std::chrono::milliseconds timeout)
+{
+	std::vector<uint8_t> data;
+	auto result = download_segmented(skylink, segments, [&data](size_t offset, uint8_t const * chunk, size_t size) {
+		memcpy(data.data() + offset, chunk, size);
+	}, portals, timeout, &data);
+	result.data = std::move(data);
+	return result;
+}
+
+skynet::response skynet::download_segmented(std::string const & skylink, size_t segments, positional_sink const & output, std::vector<portal_options> const & portals, std::chrono::milliseconds timeout)
 {
-	session->SetUrl(trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink));
-	session->SetParameters({{"format","concat"}});
-	session->SetTimeout(timeout);
-	auto response = session->Head();
+	return download_segmented(skylink, segments, output, portals, timeout, nullptr);
+}
+
+skynet::response skynet::download_segmented_file(std::string const & path, std::string const & skylink, size_t segments, std::vector<portal_options> const & portals, std::chrono::milliseconds timeout)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) { throw std::runtime_error("Failed to open " + path); }
 
-	if (response.error) {
-		throw std::runtime_error(response.error.message);
-	} else if (response.status_code != 200) {
-		throw std::runtime_error("HEAD request failed with status code " + std::to_string(response.status_code));
+	response result;
+	try {
+		result = download_segmented(skylink, segments, [fd, &path](size_t offset, uint8_t const * data, size_t size) {
+			while (size) {
+				ssize_t written = pwrite(fd, data, size, offset);
+				if (written < 0) {
+					if (errno == EINTR) { continue; }
+					throw std::runtime_error("Failed to write contents of " + path + ": " + strerror(errno));
+				}
+				data += written;
+				offset += written;
+				size -= written;
+			}
+		}, portals, timeout);
+	} catch (...) {
+		close(fd);
+		throw;
 	}
 
-	skynet::response result;
-	result.skylink = skylink;
-	result.portal = options;
-	result.filename = extractContentDispositionFilename(response.header["content-disposition"]);
-	result.metadata = parseCprResponse(response);
+	if (close(fd) != 0) { throw std::runtime_error("Failed to write contents of " + path); }
 
 	return result;
 }
 
-skynet::response skynet::download_file(std::string const & path, std::string const & skylink, std::chrono::milliseconds timeout)
-{ 
-	response result = download(skylink, {}, timeout);
-	
-	write_file(path, result.data);
+skynet::response skynet::download_segmented(std::string const & skylink, size_t segments, positional_sink const & output, std::vector<portal_options> const & portals, std::chrono::milliseconds timeout, std::vector<uint8_t> * buffer)
+{
+	std::vector<portal_options> sources = portals.size() ? portals : std::vector<portal_options>{options};
+
+	response result;
+	for (size_t source = 0; source < sources.size(); ++ source) {
+		try {
+			result = skynet(sources[source]).query(skylink, timeout);
+			break;
+		} catch (std::exception const &) {
+			if (source + 1 == sources.size()) { throw; }
+		}
+	}
+	size_t length = result.metadata.len;
+	if (!length) {
+		// no length to split by; fetch it whole
+		size_t position = 0;
+		sink whole_output = [&](uint8_t const * data, size_t size) {
+			if (buffer) {
+				buffer->insert(buffer->end(), data, data + size);
+			} else {
+				output(position, data, size);
+			}
+			position += size;
+		};
+		result = skynet(result.portal).perform_download(skylink, {}, &whole_output, timeout);
+		result.dataranges = {{0, position}};
+		return result;
+	}
+	if (buffer) {
+		buffer->resize(length);
+	}
+
+	segments = std::max<size_t>(1, std::min(segments, (length + min_segment_size - 1) / min_segment_size));
+	size_t segment_size = (length + segments - 1) / segments;
 
+	std::vector<std::pair<size_t, size_t>> ranges;
+	for (size_t offset = 0; offset < length; offset += segment_size) {
+		ranges.emplace_back(offset, std::min(segment_size, length - offset));
+	}
+
+	// every segment is started at once; the attempt number picks the portal, so retries move on
+	std::vector<size_t> attempts(ranges.size(), 0);
+	std::vector<size_t> remaining(ranges.size());
+	for (size_t index = 0; index < ranges.size(); ++ index) {
+		remaining[index] = index;
+	}
+	std::exception_ptr error;
+	while (remaining.size()) {
+		std::vector<std::future<response>> transfers;
+		for (size_t index : remaining) {
+			auto range = ranges[index];
+			size_t position = range.first;
+			transfers.emplace_back(skynet(sources[(index + attempts[index]) % sources.size()]).async_download(skylink, {range}, [&output, position](uint8_t const * data, size_t size) mutable {
+				output(position, data, size);
+				position += size;
+			}, timeout));
+		}
+		std::vector<size_t> failed;
+		for (size_t transfer = 0; transfer < transfers.size(); ++ transfer) {
+			size_t index = remaining[transfer];
+			try {
+				transfers[transfer].get();
+			} catch (...) {
+				++ attempts[index];
+				if (attempts[index] < sources.size()) {
+					failed.push_back(index);
+				} else if (!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		remaining = failed;
+	}
+
+	result.dataranges = {{0, length}};
 	return result;
 }
 
-skynet::response skynet::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, std::chrono::milliseconds timeout)
+skynet::response skynet::download_vectored(std::string const & skylink, std::vector<read_request> const & reads, size_t gap, size_t max_ranges, std::chrono::milliseconds timeout)
 {
-	skynet::response result;
-	session->SetUrl(trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink));
+	if (!max_ranges) {
+		throw std::invalid_argument("download_vectored needs max_ranges of at least 1");
+	}
+	std::vector<read_request> sorted;
+	for (auto & read : reads) {
+		if (read.length) {
+			sorted.emplace_back(read);
+		}
+	}
+	if (!sorted.size()) {
+		return query(skylink, timeout);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](read_request const & left, read_request const & right) {
+		return left.offset < right.offset;
+	});
 
-	if (ranges.size()) {
-		std::string header_content;
-		bool first = true;
-		for (auto range: ranges) {
-			result.dataranges.emplace_back(range);
-			if (first) {
-				header_content += "bytes=";
+	// reads within gap of each other become one range
+	std::vector<std::pair<size_t, size_t>> spans;
+	std::vector<size_t> max_end(sorted.size());
+	size_t end = 0;
+	for (size_t index = 0; index < sorted.size(); ++ index) {
+		auto & read = sorted[index];
+		if (spans.size() && read.offset <= end + gap) {
+			end = std::max(end, read.offset + read.length);
+			spans.back().second = end - spans.back().first;
+		} else {
+			end = read.offset + read.length;
+			spans.emplace_back(read.offset, read.length);
+		}
+		max_end[index] = end;
+	}
+
+	// called only from the transfer thread, so needs no locking
+	std::vector<size_t> filled(sorted.size(), 0);
+	positional_sink scatter = [&](size_t position, uint8_t const * data, size_t size) {
+		size_t data_end = position + size;
+		// max_end is nondecreasing, so the first read that can overlap is found by bisection
+		size_t index = std::upper_bound(max_end.begin(), max_end.end(), position) - max_end.begin();
+		for (; index < sorted.size() && sorted[index].offset < data_end; ++ index) {
+			auto & read = sorted[index];
+			size_t from = std::max(position, read.offset);
+			size_t to = std::min(data_end, read.offset + read.length);
+			if (from >= to) { continue; }
+			memcpy(read.buffer + (from - read.offset), data + (from - position), to - from);
+			filled[index] += to - from;
+		}
+	};
+
+	std::vector<std::shared_ptr<std::promise<response>>> transfers;
+	for (size_t first = 0; first < spans.size(); first += max_ranges) {
+		std::vector<std::pair<size_t, size_t>> group(spans.begin() + first, spans.begin() + std::min(first + max_ranges, spans.size()));
+		auto promise = std::make_shared<std::promise<response>>();
+		transfers.emplace_back(promise);
+		submit_download(skylink, group, nullptr, scatter, [promise](response * result, std::exception_ptr error) {
+			if (error) {
+				promise->set_exception(error);
 			} else {
-				header_content += ", ";
+				promise->set_value(std::move(*result));
 			}
-			header_content += std::to_string(range.first) + "-" + std::to_string(range.first + range.second - 1);
-			first = false;
+		}, timeout);
+	}
+
+	response result;
+	std::exception_ptr error;
+	for (size_t index = 0; index < transfers.size(); ++ index) {
+		try {
+			auto transfer = transfers[index]->get_future().get();
+			if (!index) {
+				result = transfer;
+			} else {
+				result.dataranges.insert(result.dataranges.end(), transfer.dataranges.begin(), transfer.dataranges.end());
+			}
+		} catch (...) {
+			if (!error) { error = std::current_exception(); }
 		}
-		session->SetHeader({{"Range", header_content}});
 	}
-	session->SetParameters({{"format","concat"}});
-	session->SetTimeout(timeout);
+	if (error) { std::rethrow_exception(error); }
 
-	auto response = session->Get();
+	for (size_t index = 0; index < sorted.size(); ++ index) {
+		if (filled[index] < sorted[index].length) {
+			throw std::runtime_error("Range reply did not cover offset " + std::to_string(sorted[index].offset));
+		}
+	}
 
-	session->SetHeader({});
+	return result;
+}
 
-	if (response.error) {
-		throw std::runtime_error(response.error.message);
-	} else if (response.status_code != 200) {
-		if (!ranges.size() || response.status_code != 206) {
-			throw std::runtime_error(response.text);
+std::future<skynet::response> skynet::async_query(std::string const & skylink, std::chrono::milliseconds timeout)
+{
+	auto promise = std::make_shared<std::promise<response>>();
+	async_query(skylink, [promise](response * result, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(std::move(*result));
+		}
+	}, timeout);
+	return promise->get_future();
+}
+
+std::future<skynet::response> skynet::async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges, std::chrono::milliseconds timeout)
+{
+	return async_download(skylink, ranges, sink(), timeout);
+}
+
+std::future<skynet::response> skynet::async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges, sink output, std::chrono::milliseconds timeout)
+{
+	auto promise = std::make_shared<std::promise<response>>();
+	async_download(skylink, ranges, output, [promise](response * result, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(std::move(*result));
+		}
+	}, timeout);
+	return promise->get_future();
+}
+
+std::future<std::string> skynet::async_upload(upload_data && file, std::chrono::milliseconds timeout, request_timing * timing)
+{
+	auto promise = std::make_shared<std::promise<std::string>>();
+	async_upload(std::move(file), [promise](std::string const * skylink, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(*skylink);
+		}
+	}, timeout, {}, timing);
+	return promise->get_future();
+}
+
+std::future<std::string> skynet::async_upload(std::string const & filename, std::vector<upload_data> && files, std::chrono::milliseconds timeout, request_timing * timing)
+{
+	auto promise = std::make_shared<std::promise<std::string>>();
+	async_upload(filename, std::move(files), [promise](std::string const * skylink, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(*skylink);
+		}
+	}, timeout, {}, timing);
+	return promise->get_future();
+}
+
+void skynet::cancellation::cancel()
+{
+	flag = true;
+	transfer_engine::instance().wake_cancelled();
+}
+
+void skynet::async_query(std::string const & skylink, response_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel)
+{
+	std::unique_ptr<async_request> state(new async_request(options.url));
+	state->cancel = cancel;
+	prepareQuery(state->request, trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink) + "?format=concat", timeout);
+	state->complete = [skylink, portal = options, completion](async_request & state, CURLcode code) {
+		response result;
+		std::exception_ptr error;
+		try {
+			checkRequest(state.request, code);
+			result = finishQuery(state.request, skylink, portal);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		completion(error ? nullptr : &result, error);
+	};
+	transfer_engine::instance().submit(std::move(state));
+}
+
+void skynet::async_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> ranges, sink output, response_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel)
+{
+	submit_download(skylink, ranges, output, nullptr, completion, timeout, cancel);
+}
+
+void skynet::submit_download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, sink output, positional_sink positional, response_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel)
+{
+	std::unique_ptr<async_request> state(new async_request(options.url));
+	state->cancel = cancel;
+	state->output = output;
+	state->positional = positional;
+	state->request.output = output ? &state->output : nullptr;
+	state->request.positional = positional ? &state->positional : nullptr;
+	prepareDownload(state->request, trimTrailingSlash(options.url) + "/" + trimSiaPrefix(skylink) + "?format=concat", ranges, timeout);
+	state->complete = [skylink, portal = options, completion](async_request & state, CURLcode code) {
+		response result;
+		std::exception_ptr error;
+		try {
+			checkRequest(state.request, code);
+			result = finishDownload(state.request, skylink, portal);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		completion(error ? nullptr : &result, error);
+	};
+	transfer_engine::instance().submit(std::move(state));
+}
+
+void skynet::async_upload(upload_data && file, upload_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel, request_timing * timing)
+{
+	std::string filename = file.filename;
+	std::vector<upload_data> files;
+	files.emplace_back(std::move(file));
+	submit_upload(std::move(files), filename, options.fileFieldname, completion, timeout, cancel, timing);
+}
+
+void skynet::async_upload(std::string const & filename, std::vector<upload_data> && files, upload_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel, request_timing * timing)
+{
+	submit_upload(std::move(files), filename, options.directoryFileFieldname, completion, timeout, cancel, timing);
+}
+
+void skynet::submit_upload(std::vector<upload_data> && files, std::string const & filename, std::string const & field, upload_callback completion, std::chrono::milliseconds timeout, std::shared_ptr<cancellation> cancel, request_timing * timing)
+{
+	std::unique_ptr<async_request> state(new async_request(options.url));
+	state->cancel = cancel;
+	state->files = std::move(files);
+	prepareUpload(state->request, state->files, filename, trimTrailingSlash(options.url) + "/" + trimLeadingSlash(trimTrailingSlash(options.uploadPath)), field, timeout);
+	state->complete = [completion, timing](async_request & state, CURLcode code) {
+		std::string skylink;
+		std::exception_ptr error;
+		try {
+			checkRequest(state.request, code);
+			skylink = finishUpload(state.request, timing);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		completion(error ? nullptr : &skylink, error);
+	};
+	transfer_engine::instance().submit(std::move(state));
+}
+
+static void prepareQuery(curl_request & request, std::string const & url, std::chrono::milliseconds timeout)
+{
+	prepareRequest(request, url, timeout);
+	curl_easy_setopt(request.handle, CURLOPT_NOBODY, 1L);
+}
+
+static skynet::response headerResponse(curl_request & request, std::string const & skylink, skynet::portal_options const & portal)
+{
+	skynet::response result;
+	result.skylink = skylink;
+	result.portal = portal;
+	result.filename = extractContentDispositionFilename(request.header["content-disposition"]);
+	result.metadata = parseMetadataHeaders(request.header);
+	return result;
+}
+
+static skynet::response finishQuery(curl_request & request, std::string const & skylink, skynet::portal_options const & portal)
+{
+	if (request.status_code != 200) {
+		throw skynet::http_error(request.status_code, "HEAD request failed with status code " + std::to_string(request.status_code));
+	}
+
+	skynet::response result = headerResponse(request, skylink, portal);
+	result.timing = requestTiming(request.handle);
+
+	return result;
+}
+
+static void prepareDownload(curl_request & request, std::string const & url, std::vector<std::pair<size_t, size_t>> const & ranges, std::chrono::milliseconds timeout)
+{
+	prepareRequest(request, url, timeout);
+	request.ranges = ranges;
+
+	if (ranges.size()) {
+		std::string range_spec;
+		for (auto range: ranges) {
+			if (range_spec.size()) {
+				range_spec += ",";
+			}
+			range_spec += std::to_string(range.first) + "-";
+			if (range.second != skynet::to_end) {
+				range_spec += std::to_string(range.first + range.second - 1);
+			}
+		}
+		// curl formats the Range header itself from the byte spec
+		curl_easy_setopt(request.handle, CURLOPT_RANGE, range_spec.c_str());
+	}
+}
+
+static skynet::response finishDownload(curl_request & request, std::string const & skylink, skynet::portal_options const & portal)
+{
+	if (request.status_code != 200) {
+		if (!request.ranges.size() || request.status_code != 206) {
+			throw skynet::http_error(request.status_code, std::string(request.body.begin(), request.body.end()));
 		}
-	} else if (ranges.size()) {
+	} else if (request.ranges.size()) {
 		throw std::runtime_error("Server does not support partial ranges.");
 	}
 
-	result.skylink = skylink;
-	result.portal = options;
-	result.filename = extractContentDispositionFilename(response.header["content-disposition"]);
-	result.metadata = parseCprResponse(response);
-	uint8_t bytes[256];
-	memset(bytes, 0, sizeof(bytes));
-	for (size_t w = 0; w < response.text.size(); w ++) {
-		bytes[response.text[w]] ++;
-	}
-	result.data = std::vector<uint8_t>(response.text.begin(), response.text.end());
-	if (!ranges.size()) {
+	skynet::response result = headerResponse(request, skylink, portal);
+	result.timing = requestTiming(request.handle);
+	if (!request.output && !request.positional) {
+		result.data = std::move(request.body);
+	}
+	result.dataranges = request.received_ranges.size() ? request.received_ranges : request.ranges;
+	if (!result.dataranges.size()) {
 		result.dataranges.emplace_back(0, result.metadata.len);
 	}
 
 	return result;
 }
 
+static void prepareUpload(curl_request & request, std::vector<skynet::upload_data> const & files, std::string const & filename, std::string const & url, std::string const & field, std::chrono::milliseconds timeout)
+{
+	CURL * curl = request.handle;
+	char * escaped_filename = curl_easy_escape(curl, filename.c_str(), filename.size());
+	std::string full_url = url + "?filename=" + escaped_filename;
+	curl_free(escaped_filename);
+
+	prepareRequest(request, full_url, timeout);
+
+	// parts are sent from the caller's memory or reader through sendPart, never copied whole
+	request.mime.reset(curl_mime_init(curl));
+	request.cursors.resize(files.size());
+	for (size_t index = 0; index < files.size(); ++ index) {
+		auto & file = files[index];
+		request.cursors[index] = {&file, 0, &request.exception};
+
+		curl_mimepart * part = curl_mime_addpart(request.mime.get());
+		curl_mime_name(part, field.c_str());
+		curl_mime_filename(part, file.filename.c_str());
+		if (file.contenttype.size()) {
+			curl_mime_type(part, file.contenttype.c_str());
+		}
+		curl_off_t size;
+		if (file.reader) {
+			size = file.reader_size == skynet::upload_data::unknown_size ? -1 : (curl_off_t)file.reader_size;
+		} else {
+			size = file.span ? file.span_size : file.data.size();
+		}
+		curl_mime_data_cb(part, size, sendPart, file.reader ? nullptr : seekPart, nullptr, &request.cursors[index]);
+	}
+	curl_easy_setopt(curl, CURLOPT_MIMEPOST, request.mime.get());
+}
+
+static std::string finishUpload(curl_request & request, skynet::request_timing * timing)
+{
+	if (timing) {
+		*timing = requestTiming(request.handle);
+	}
+	if (request.status_code != 200) {
+		throw skynet::http_error(request.status_code, std::string(request.body.begin(), request.body.end()));
+	}
+	
+	auto json = nlohmann::json::parse(request.body);
+
+	std::string skylink = "sia://" + json["skylink"].get<std::string>();
+
+	return skylink;
+}
+
+static skynet::request_timing requestTiming(CURL * handle)
+{
+	skynet::request_timing result;
+	curl_off_t value;
+	if (curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &value) == CURLE_OK) { result.name_lookup = std::chrono::microseconds(value); }
+	if (curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &value) == CURLE_OK) { result.connect = std::chrono::microseconds(value); }
+	if (curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &value) == CURLE_OK) { result.app_connect = std::chrono::microseconds(value); }
+	if (curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &value) == CURLE_OK) { result.start_transfer = std::chrono::microseconds(value); }
+	if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &value) == CURLE_OK) { result.total = std::chrono::microseconds(value); }
+	if (curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &value) == CURLE_OK) { result.bytes_sent = value; }
+	if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &value) == CURLE_OK) { result.bytes_received = value; }
+	long version = 0;
+	curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &version);
+	switch (version) {
+	case CURL_HTTP_VERSION_1_0: result.http_version = "1.0"; break;
+	case CURL_HTTP_VERSION_1_1: result.http_version = "1.1"; break;
+	case CURL_HTTP_VERSION_2_0: result.http_version = "2"; break;
+	case CURL_HTTP_VERSION_3: result.http_version = "3"; break;
+	}
+	return result;
+}
+
 skynet::response::subfile parse_subfile(size_t & offset, nlohmann::json const & value)
 {
 	size_t suboffset = offset;
@@ -264,26 +1202,32 @@ skynet::response::subfile parse_subfile(size_t & offset, nlohmann::json const &
 		return metadata;
 	}
 
+	// portals report where each subfile starts; without that they are taken to be in listed order
+	size_t subend = suboffset;
 	for (auto & subfile : value["subfiles"].items()) {
+		if (subfile.value().contains("offset")) {
+			suboffset = metadata.offset + subfile.value()["offset"].get<size_t>();
+		}
 		metadata.subfiles.emplace_back(subfile.key(), parse_subfile(suboffset, subfile.value()));
+		subend = std::max(subend, suboffset);
 	}
 
-	if (suboffset > offset) {
+	if (subend > offset) {
 		// this is intended to fix those times when content-length is not provided and the outermost metadata.len is 0
-		metadata.len += suboffset - offset;
-		offset = suboffset;
+		metadata.len += subend - offset;
+		offset = subend;
 	}
 
 	return metadata;
 }
 
-skynet::response::subfile parseCprResponse(cpr::Response & cpr)
+skynet::response::subfile parseMetadataHeaders(header_map & header)
 {
-	auto & raw_json = cpr.header["skynet-file-metadata"];
+	auto & raw_json = header["skynet-file-metadata"];
 	auto parsed_json = raw_json.empty() ? nlohmann::json({}) : nlohmann::json::parse(raw_json);
-	auto len = cpr.header["content-length"];
-	parsed_json["len"] = len.size() ? std::stoul(cpr.header["content-length"]) : 0;
-	parsed_json["contenttype"] = cpr.header["content-type"];
+	auto len = header["content-length"];
+	parsed_json["len"] = len.size() ? std::stoul(len) : 0;
+	parsed_json["contenttype"] = header["content-type"];
 
 	size_t offset = 0;
 	return parse_subfile(offset, parsed_json);
@@ -310,30 +1254,431 @@ std::string extractContentDispositionFilename(std::string const & content_dispos
 	return { content_disposition.begin() + start, content_disposition.begin() + end };
 }
 
-static void read_file(std::string const & path, std::vector<uint8_t> & buffer)
+static size_t sendPart(char * buffer, size_t size, size_t count, void * userdata)
 {
-	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+	part_cursor & cursor = *(part_cursor *)userdata;
+	auto & file = *cursor.file;
+	size *= count;
 
-	if (!file.is_open()) { throw std::runtime_error("Failed to open " + path); }
+	if (file.reader) {
+		try {
+			size = file.reader((uint8_t *)buffer, size);
+		} catch (...) {
+			*cursor.exception = std::current_exception();
+			return CURL_READFUNC_ABORT;
+		}
+	} else {
+		uint8_t const * data = file.span ? file.span : file.data.data();
+		size_t total = file.span ? file.span_size : file.data.size();
+		size = std::min(size, total - cursor.offset);
+		memcpy(buffer, data + cursor.offset, size);
+	}
+	cursor.offset += size;
+	return size;
+}
 
-	std::streamsize size = file.tellg();
-	file.seekg(0, std::ios::beg);
+static int seekPart(void * userdata, curl_off_t offset, int origin)
+{
+	part_cursor & cursor = *(part_cursor *)userdata;
+	if (origin != SEEK_SET) { return CURL_SEEKFUNC_CANTSEEK; }
+	cursor.offset = offset;
+	return CURL_SEEKFUNC_OK;
+}
 
-	buffer.resize(size);
-	file.read((char*)buffer.data(), size * sizeof(uint8_t) / sizeof(char));
+transfer_engine & transfer_engine::instance()
+{
+	static transfer_engine engine;
+	return engine;
+}
 
-	if (file.fail()) { throw std::runtime_error("Failed to read contents of " + path); }
+transfer_engine::transfer_engine()
+{
+	// the pool is used by requests and must outlive the engine
+	connection_pool::instance();
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	thread = std::thread(&transfer_engine::run, this);
 }
 
-static void write_file(std::string const & path, std::vector<uint8_t> const & buffer)
+transfer_engine::~transfer_engine()
 {
-	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	curl_multi_wakeup(multi);
+	thread.join();
+	curl_multi_cleanup(multi);
+}
 
-	if (!file.is_open()) { throw std::runtime_error("Failed to open " + path); }
+void transfer_engine::submit(std::unique_ptr<async_request> request)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.emplace_back(std::move(request));
+	}
+	curl_multi_wakeup(multi);
+}
+
+void transfer_engine::wake_cancelled()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelling = true;
+	}
+	curl_multi_wakeup(multi);
+}
 
-	file.write((char*)buffer.data(), buffer.size() * sizeof(uint8_t) / sizeof(char));
+void transfer_engine::run()
+{
+	while (true) {
+		bool cancelled;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping) { break; }
+			for (auto & request : pending) {
+				CURL * handle = request->request.handle;
+				// wait for an http/2 connection to multiplex on, rather than opening more.
+				// only here: blocking requests on other threads would wait on each other.
+				curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+				curl_multi_add_handle(multi, handle);
+				if (request->cancel && request->cancel->cancelled()) { cancelling = true; }
+				active[handle] = std::move(request);
+			}
+			pending.clear();
+			cancelled = cancelling;
+			cancelling = false;
+		}
 
-	if (file.fail()) { throw std::runtime_error("Failed to write contents of " + path); }
+		if (cancelled) {
+			for (auto entry = active.begin(); entry != active.end();) {
+				if (!entry->second->cancel || !entry->second->cancel->cancelled()) {
+					++ entry;
+					continue;
+				}
+				curl_multi_remove_handle(multi, entry->first);
+				auto request = std::move(entry->second);
+				entry = active.erase(entry);
+				try {
+					request->request.exception = std::make_exception_ptr(std::runtime_error("Transfer cancelled"));
+					request->complete(*request, CURLE_ABORTED_BY_CALLBACK);
+				} catch (...) { }
+			}
+		}
+
+		int running;
+		curl_multi_perform(multi, &running);
+
+		CURLMsg * message;
+		int remaining;
+		while ((message = curl_multi_info_read(multi, &remaining))) {
+			if (message->msg != CURLMSG_DONE) { continue; }
+			CURL * handle = message->easy_handle;
+			CURLcode code = message->data.result;
+			curl_multi_remove_handle(multi, handle);
+			auto request = std::move(active[handle]);
+			active.erase(handle);
+			try {
+				request->complete(*request, code);
+			} catch (...) { }
+		}
+
+		curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+	}
+
+	// fail whatever is left so nobody waits forever
+	for (auto & request : pending) {
+		CURL * handle = request->request.handle;
+		active[handle] = std::move(request);
+	}
+	pending.clear();
+	for (auto & entry : active) {
+		curl_multi_remove_handle(multi, entry.first);
+		try {
+			entry.second->complete(*entry.second, CURLE_ABORTED_BY_CALLBACK);
+		} catch (...) { }
+	}
+	active.clear();
+}
+
+connection_pool & connection_pool::instance()
+{
+	static connection_pool pool;
+	return pool;
+}
+
+connection_pool::~connection_pool()
+{
+	for (auto & entry : portals) {
+		for (CURL * handle : entry.second->idle) {
+			curl_easy_cleanup(handle);
+		}
+		curl_share_cleanup(entry.second->share);
+	}
+}
+
+CURL * connection_pool::acquire(std::string const & portal_url)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto & portal = portals[portal_url];
+	if (!portal) {
+		initCurl();
+		portal.reset(new portal_entry());
+		portal->share = curl_share_init();
+		curl_share_setopt(portal->share, CURLSHOPT_LOCKFUNC, connection_pool::lock);
+		curl_share_setopt(portal->share, CURLSHOPT_UNLOCKFUNC, connection_pool::unlock);
+		curl_share_setopt(portal->share, CURLSHOPT_USERDATA, portal.get());
+		curl_share_setopt(portal->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(portal->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(portal->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	}
+	if (portal->idle.size()) {
+		CURL * handle = portal->idle.back();
+		portal->idle.pop_back();
+		return handle;
+	}
+	CURL * handle = curl_easy_init();
+	configure(handle, *portal);
+	return handle;
+}
+
+void connection_pool::release(std::string const & portal_url, CURL * handle)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto & portal = *portals[portal_url];
+	if (portal.idle.size() >= max_idle_handles) {
+		curl_easy_cleanup(handle);
+		return;
+	}
+	// reset drops request options but keeps the handle's caches
+	curl_easy_reset(handle);
+	configure(handle, portal);
+	portal.idle.push_back(handle);
+}
+
+void connection_pool::configure(CURL * handle, portal_entry & portal)
+{
+	curl_easy_setopt(handle, CURLOPT_SHARE, portal.share);
+	curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, dns_cache_seconds);
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+}
+
+void connection_pool::lock(CURL *, curl_lock_data data, curl_lock_access, void * userptr)
+{
+	((portal_entry *)userptr)->locks[data].lock();
+}
+
+void connection_pool::unlock(CURL *, curl_lock_data data, void * userptr)
+{
+	((portal_entry *)userptr)->locks[data].unlock();
+}
+
+static void initCurl()
+{
+	static std::once_flag once;
+	std::call_once(once, []{
+		curl_global_init(CURL_GLOBAL_ALL);
+	});
+}
+
+static void prepareRequest(curl_request & request, std::string const & url, std::chrono::milliseconds timeout)
+{
+	CURL * handle = request.handle;
+	request.error[0] = 0;
+	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, (long)timeout.count());
+	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, request.error);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, receiveHeader);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &request);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, receiveBody);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &request);
+}
+
+static void performRequest(curl_request & request)
+{
+	checkRequest(request, curl_easy_perform(request.handle));
+}
+
+static void checkRequest(curl_request & request, CURLcode code)
+{
+	if (request.exception) {
+		std::rethrow_exception(request.exception);
+	}
+	if (code != CURLE_OK) {
+		throw std::runtime_error(request.error[0] ? request.error : curl_easy_strerror(code));
+	}
+}
+
+static size_t receiveHeader(char * data, size_t size, size_t count, void * userdata)
+{
+	curl_request & request = *(curl_request *)userdata;
+	size *= count;
+
+	std::string line(data, size);
+	while (line.size() && (line.back() == '\n' || line.back() == '\r')) {
+		line.pop_back();
+	}
+
+	if (0 == line.compare(0, 5, "HTTP/")) {
+		// a new status line starts a new set of headers, e.g. after a redirect
+		request.header.clear();
+		auto space = line.find(' ');
+		request.status_code = space == std::string::npos ? 0 : std::strtol(line.c_str() + space + 1, nullptr, 10);
+		return size;
+	}
+
+	auto colon = line.find(':');
+	if (colon == std::string::npos) { return size; }
+
+	auto value_start = line.find_first_not_of(" \t", colon + 1);
+	std::string value = value_start == std::string::npos ? std::string() : line.substr(value_start);
+	auto & entry = request.header[line.substr(0, colon)];
+	entry = entry.empty() ? value : entry + ", " + value;
+
+	if (!request.output && !request.positional && strcasecmp(line.substr(0, colon).c_str(), "content-length") == 0) {
+		request.body.reserve(std::strtoull(value.c_str(), nullptr, 10));
+	}
+
+	return size;
+}
+
+static size_t receiveBody(char * data, size_t size, size_t count, void * userdata)
+{
+	curl_request & request = *(curl_request *)userdata;
+	size *= count;
+
+	bool success = request.status_code == 200 || request.status_code == 206;
+	if (success && request.ranges.size() && request.status_code == 200) {
+		// would otherwise stream the whole file where a range was asked for
+		request.exception = std::make_exception_ptr(std::runtime_error("Server does not support partial ranges."));
+		return 0;
+	}
+	if (!success) {
+		request.body.insert(request.body.end(), (uint8_t *)data, (uint8_t *)data + size);
+		return size;
+	}
+
+	try {
+		if (request.status_code == 206) {
+			receiveRanges(request, (uint8_t const *)data, size);
+		} else {
+			deliverBody(request, (uint8_t const *)data, size);
+		}
+	} catch (...) {
+		request.exception = std::current_exception();
+		return 0;
+	}
+	return size;
+}
+
+static void receiveRanges(curl_request & request, uint8_t const * data, size_t size)
+{
+	auto & parts = request.parts;
+	if (!parts.started) {
+		parts.started = true;
+		auto & type = request.header["content-type"];
+		if (0 == strncasecmp(type.c_str(), "multipart/byteranges", 20)) {
+			auto start = type.find("boundary=");
+			if (start == std::string::npos) { throw std::runtime_error("multipart/byteranges reply has no boundary"); }
+			auto boundary = type.substr(start + 9, type.find(';', start) - start - 9);
+			if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+				boundary = boundary.substr(1, boundary.size() - 2);
+			}
+			parts.boundary = "--" + boundary;
+		} else {
+			size_t start, length;
+			if (!parseContentRange(request.header["content-range"], start, length)) {
+				start = request.ranges.front().first;
+				length = request.ranges.front().second;
+			}
+			request.received_ranges.emplace_back(start, length);
+			parts.position = start;
+		}
+	}
+
+	if (parts.boundary.empty()) {
+		deliverBody(request, data, size);
+		return;
+	}
+
+	std::string rest; // what followed a part's headers, while it is delivered
+	while (size && !parts.closed) {
+		if (parts.remaining) {
+			size_t chunk = std::min(size, parts.remaining);
+			deliverBody(request, data, chunk);
+			parts.remaining -= chunk;
+			data += chunk;
+			size -= chunk;
+			continue;
+		}
+
+		// between parts, so buffer until the next part's headers are complete
+		parts.header.append((char const *)data, size);
+		size = 0;
+
+		auto boundary = parts.header.find(parts.boundary);
+		if (boundary == std::string::npos) { return; }
+		auto after_boundary = boundary + parts.boundary.size();
+		if (parts.header.size() < after_boundary + 2) { return; }
+		if (0 == parts.header.compare(after_boundary, 2, "--")) {
+			parts.closed = true;
+			return;
+		}
+		auto headers_end = parts.header.find("\r\n\r\n", after_boundary);
+		if (headers_end == std::string::npos) { return; }
+
+		size_t start = 0, length = 0;
+		bool found = false;
+		for (size_t line = after_boundary; line < headers_end;) {
+			auto line_end = parts.header.find("\r\n", line);
+			auto colon = parts.header.find(':', line);
+			if (colon < line_end && 0 == strncasecmp(parts.header.c_str() + line, "content-range", colon - line)) {
+				found = parseContentRange(parts.header.substr(colon + 1, line_end - colon - 1), start, length);
+			}
+			line = line_end + 2;
+		}
+		if (!found) { throw std::runtime_error("multipart/byteranges part has no content-range"); }
+		request.received_ranges.emplace_back(start, length);
+		parts.position = start;
+		parts.remaining = length;
+
+		// whatever followed the headers is body, and perhaps more parts
+		rest = parts.header.substr(headers_end + 4);
+		parts.header.clear();
+		data = (uint8_t const *)rest.data();
+		size = rest.size();
+	}
+}
+
+static void deliverBody(curl_request & request, uint8_t const * data, size_t size)
+{
+	if (request.positional) {
+		(*request.positional)(request.parts.position, data, size);
+	} else if (request.output) {
+		(*request.output)(data, size);
+	} else {
+		request.body.insert(request.body.end(), data, data + size);
+	}
+	request.parts.position += size;
+}
+
+static bool parseContentRange(std::string const & content_range, size_t & start, size_t & length)
+{
+	// bytes <first>-<last>/<total>
+	auto bytes = content_range.find("bytes");
+	if (bytes == std::string::npos) { return false; }
+	char * end;
+	char const * text = content_range.c_str() + bytes + 5;
+	start = std::strtoull(text, &end, 10);
+	if (end == text || *end != '-') { return false; }
+	text = end + 1;
+	size_t last = std::strtoull(text, &end, 10);
+	if (end == text || last < start) { return false; }
+	length = last - start + 1;
+	return true;
 }
 
 }
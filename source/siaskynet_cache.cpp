@@ -0,0 +1,320 @@
+#include <siaskynet_cache.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sia {
+
+static nlohmann::json storeSubfile(skynet::response::subfile const & subfile);
+static skynet::response::subfile loadSubfile(nlohmann::json const & value);
+static std::string hashKey(std::string const & key);
+
+skynet_cache::skynet_cache(std::string directory, size_t max_bytes)
+: directory(directory.size() && directory.back() == '/' ? directory.substr(0, directory.size() - 1) : directory),
+  max_bytes(max_bytes)
+{
+	if (mkdir(this->directory.c_str(), 0755) != 0 && errno != EEXIST) {
+		throw std::runtime_error("Failed to create " + this->directory + ": " + strerror(errno));
+	}
+
+	// pick up entries left by earlier runs, least recently used first
+	std::vector<std::pair<timespec, item>> found;
+	DIR * dir = opendir(this->directory.c_str());
+	if (!dir) { throw std::runtime_error("Failed to open " + this->directory + ": " + strerror(errno)); }
+	while (dirent * ent = readdir(dir)) {
+		std::string filename = ent->d_name;
+		if (filename.size() < 5 || filename.compare(filename.size() - 5, 5, ".data") != 0) { continue; }
+		std::string name = filename.substr(0, filename.size() - 5);
+		struct stat data_stat, meta_stat;
+		if (stat((this->directory + "/" + filename).c_str(), &data_stat) != 0) { continue; }
+		if (stat((this->directory + "/" + name + ".json").c_str(), &meta_stat) != 0) { continue; }
+		found.emplace_back(data_stat.st_mtim, item{name, size_t(data_stat.st_size) + size_t(meta_stat.st_size)});
+	}
+	closedir(dir);
+	std::sort(found.begin(), found.end(), [](auto const & a, auto const & b) {
+		return a.first.tv_sec < b.first.tv_sec || (a.first.tv_sec == b.first.tv_sec && a.first.tv_nsec < b.first.tv_nsec);
+	});
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto & entry : found) {
+		insert(entry.second.name, entry.second.size);
+	}
+	evict();
+}
+
+std::string skynet_cache::key(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges)
+{
+	std::string result = skylink;
+	if (result.compare(0, 6, "sia://") == 0) { result = result.substr(6); }
+	while (result.size() && result.back() == '/') { result.pop_back(); }
+	for (auto & range : ranges) {
+		result += " " + std::to_string(range.first) + "-" + std::to_string(range.second);
+	}
+	return result;
+}
+
+std::string skynet_cache::name(std::string const & key)
+{
+	return hashKey(key);
+}
+
+bool skynet_cache::lookup(std::string const & key, entry & result)
+{
+	std::string name = this->name(key);
+	std::string path = directory + "/" + name;
+
+	nlohmann::json meta;
+	{
+		std::ifstream file(path + ".json");
+		if (!file.is_open()) { return false; }
+		try {
+			meta = nlohmann::json::parse(file);
+		} catch (nlohmann::json::exception const &) {
+			return false;
+		}
+	}
+	if (!meta.is_object() || meta["key"] != key) { return false; }
+
+	// a malformed entry is removed, and missed
+	skynet::response response;
+	try {
+		response.skylink = meta.at("skylink").get<std::string>();
+		response.filename = meta.at("filename").get<std::string>();
+		response.metadata = loadSubfile(meta.at("metadata"));
+		for (auto & range : meta.at("dataranges")) {
+			response.dataranges.emplace_back(range.at(0).get<size_t>(), range.at(1).get<size_t>());
+		}
+	} catch (nlohmann::json::exception const &) {
+		std::lock_guard<std::mutex> lock(mutex);
+		remove(name);
+		return false;
+	}
+
+	int fd = open((path + ".data").c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+	struct stat data_stat;
+	if (fstat(fd, &data_stat) != 0) { close(fd); return false; }
+	size_t size = data_stat.st_size;
+	void * mapping = nullptr;
+	if (size) {
+		mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) { close(fd); return false; }
+	}
+	// record the access for later runs; the file is only ever replaced, never changed
+	futimens(fd, nullptr);
+	close(fd);
+
+	result.response = std::move(response);
+	result.data = (uint8_t const *)mapping;
+	result.size = size;
+	result.mapping = std::shared_ptr<void const>(mapping, [size](void const * mapping) {
+		if (mapping) { munmap((void *)mapping, size); }
+	});
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = items.find(name);
+	if (found != items.end()) {
+		recent.splice(recent.begin(), recent, found->second);
+	} else {
+		// stored by another process
+		insert(name, size);
+		evict();
+	}
+	return true;
+}
+
+void skynet_cache::store(std::string const & key, skynet::response const & response, uint8_t const * data, size_t size)
+{
+	writer pending(*this, key);
+	pending.append(data, size);
+	pending.commit(response);
+}
+
+void skynet_cache::erase(std::string const & key)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	remove(name(key));
+}
+
+skynet_cache::writer::writer(skynet_cache & cache, std::string const & key)
+: cache(cache), key(key), path(cache.directory + "/" + cache.name(key) + ".XXXXXX"), size(0)
+{
+	fd = mkstemp(&path[0]);
+	if (fd < 0) { throw std::runtime_error("Failed to create " + path + ": " + strerror(errno)); }
+}
+
+skynet_cache::writer::~writer()
+{
+	if (fd >= 0) {
+		close(fd);
+		unlink(path.c_str());
+	}
+}
+
+void skynet_cache::writer::append(uint8_t const * data, size_t size)
+{
+	if (fd < 0) { return; }
+	this->size += size;
+	if (this->size > cache.max_bytes) {
+		// too big to keep; drop what there is now rather than when evicting
+		close(fd);
+		fd = -1;
+		unlink(path.c_str());
+		return;
+	}
+	while (size) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) { continue; }
+			throw std::runtime_error("Failed to write " + path + ": " + strerror(errno));
+		}
+		data += written;
+		size -= written;
+	}
+}
+
+void skynet_cache::writer::commit(skynet::response const & response)
+{
+	if (fd < 0) { return; }
+
+	nlohmann::json meta;
+	meta["key"] = key;
+	meta["skylink"] = response.skylink;
+	meta["filename"] = response.filename;
+	meta["metadata"] = storeSubfile(response.metadata);
+	meta["dataranges"] = nlohmann::json::array();
+	for (auto & range : response.dataranges) {
+		meta["dataranges"].push_back({range.first, range.second});
+	}
+	std::string text = meta.dump();
+
+	if (close(fd) != 0) { fd = -1; unlink(path.c_str()); throw std::runtime_error("Failed to write " + path + ": " + strerror(errno)); }
+	fd = -1;
+
+	std::string name = cache.name(key);
+	std::string base = cache.directory + "/" + name;
+
+	// the data goes in place first, so a metadata file always has its data
+	std::string meta_path = base + ".json.tmp" + path.substr(path.size() - 6);
+	{
+		std::ofstream file(meta_path, std::ios::out | std::ios::binary);
+		file << text;
+		file.close();
+		if (file.fail()) { unlink(meta_path.c_str()); unlink(path.c_str()); throw std::runtime_error("Failed to write " + meta_path); }
+	}
+	if (rename(path.c_str(), (base + ".data").c_str()) != 0 || rename(meta_path.c_str(), (base + ".json").c_str()) != 0) {
+		unlink(meta_path.c_str());
+		unlink(path.c_str());
+		throw std::runtime_error("Failed to store " + base + ": " + strerror(errno));
+	}
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.insert(name, size + text.size());
+	cache.evict();
+}
+
+size_t skynet_cache::size()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return total;
+}
+
+void skynet_cache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	while (recent.size()) {
+		remove(recent.back().name);
+	}
+}
+
+void skynet_cache::insert(std::string const & name, size_t size)
+{
+	auto found = items.find(name);
+	if (found != items.end()) {
+		total -= found->second->size;
+		recent.erase(found->second);
+	}
+	recent.push_front(item{name, size});
+	items[name] = recent.begin();
+	total += size;
+}
+
+void skynet_cache::evict()
+{
+	while (total > max_bytes && recent.size()) {
+		remove(recent.back().name);
+	}
+}
+
+void skynet_cache::remove(std::string const & name)
+{
+	// the metadata goes first, so a half-removed entry is never found.
+	// mappings of the data stay valid after it is unlinked.
+	std::string base = directory + "/" + name;
+	unlink((base + ".json").c_str());
+	unlink((base + ".data").c_str());
+
+	auto found = items.find(name);
+	if (found == items.end()) { return; }
+	total -= found->second->size;
+	recent.erase(found->second);
+	items.erase(found);
+}
+
+nlohmann::json storeSubfile(skynet::response::subfile const & subfile)
+{
+	nlohmann::json result;
+	result["contenttype"] = subfile.contenttype;
+	result["filename"] = subfile.filename;
+	result["len"] = subfile.len;
+	result["offset"] = subfile.offset;
+	// an array of pairs keeps the order of the subfiles
+	result["subfiles"] = nlohmann::json::array();
+	for (auto & entry : subfile.subfiles) {
+		result["subfiles"].push_back({entry.first, storeSubfile(entry.second)});
+	}
+	return result;
+}
+
+skynet::response::subfile loadSubfile(nlohmann::json const & value)
+{
+	skynet::response::subfile result;
+	result.contenttype = value.at("contenttype").get<std::string>();
+	result.filename = value.at("filename").get<std::string>();
+	result.len = value.at("len").get<size_t>();
+	result.offset = value.at("offset").get<size_t>();
+	for (auto & entry : value.at("subfiles")) {
+		result.subfiles.emplace_back(entry.at(0).get<std::string>(), loadSubfile(entry.at(1)));
+	}
+	return result;
+}
+
+// 64-bit FNV-1a, so names are the same across builds and processes
+std::string hashKey(std::string const & key)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned char c : key) {
+		hash ^= c;
+		hash *= 0x100000001b3ull;
+	}
+	static char const digits[] = "0123456789abcdef";
+	std::string result(16, '0');
+	for (size_t i = 0; i < 16; ++ i) {
+		result[15 - i] = digits[(hash >> (i * 4)) & 0xf];
+	}
+	return result;
+}
+
+} // namespace sia
@@ -1,88 +1,305 @@
 #include <siaskynet_multiportal.hpp>
 
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <list>
+#include <sstream>
 #include <thread>
 #include <random>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace sia {
 
-skynet_multiportal::skynet_multiportal(std::chrono::milliseconds timeout, bool do_not_set_up_portals)
+// a shared metrics file is a header and then a hash table of records by portal url.
+// every field is a 64-bit atomic, which stays lock-free between processes mapping it.
+struct shared_header {
+	std::atomic<uint64_t> magic;
+	std::atomic<uint64_t> reserved;
+};
+struct skynet_multiportal::shared_record {
+	std::atomic<uint64_t> key; // hash of the url, 0 while unclaimed
+	struct {
+		std::atomic<uint64_t> speed, first_byte, failure_rate; // doubles by bit pattern, so that zeroes are the defaults
+		std::atomic<int64_t> updated; // system clock nanoseconds of the last sample, 0 for none
+		std::atomic<uint64_t> data, successes, errors, cancellations;
+	} metrics[transfer_kind_count];
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free, "shared metrics need lock-free 64-bit atomics");
+static uint64_t const sharedMagic = 0x3253434952544d53; // "SMTRICS2"
+static size_t const sharedCapacity = 1024;
+
+// the metrics of every portal and kind, copied out under each metric's lock
+struct metric_sample {
+	std::string url;
+	char const * kind;
+	double speed, first_byte, reliability;
+	unsigned in_flight, slots;
+	int circuit;
+	unsigned consecutive_failures;
+	unsigned long long data, successes, errors, cancellations;
+	double time_to_first_byte[3], latency[3];
+};
+static double const quantiles[3] = {0.5, 0.95, 0.99};
+static char const * const kindNames[skynet_multiportal::transfer_kind_count] = {"download", "upload"};
+
+static double bucketBound(size_t index);
+static size_t uploadSize(skynet::upload_data const & file);
+static skynet::upload_data uploadAttempt(skynet::upload_data const & file);
+static std::vector<metric_sample> sampleMetrics(std::vector<skynet_multiportal::portal_metrics *> const & portals);
+static nlohmann::json storeHistogram(skynet_multiportal::decaying_histogram const & histogram);
+static void loadHistogram(skynet_multiportal::decaying_histogram & histogram, nlohmann::json const & buckets, double keep);
+static uint64_t hashUrl(std::string const & url);
+static int64_t systemNanoseconds();
+static void blendShared(std::atomic<uint64_t> & field, double sample, double weight);
+
+skynet_multiportal::skynet_multiportal(std::chrono::milliseconds timeout, bool do_not_set_up_portals, unsigned slots_per_portal, std::string const & shared_metrics)
+: slots_per_portal(slots_per_portal)
 {
+	if (!do_not_set_up_portals) {
+		for (auto portal : skynet::portals()) {
+			ensure_portal(portal);
+		}
+	}
+
+	bool known = false;
+	if (shared_metrics.size()) {
+		known = share_metrics(shared_metrics);
+	}
+
 	if (do_not_set_up_portals) { return; }
 
-	for (auto portal : skynet::portals()) {
-		ensure_portal(portal);
+	start_probes();
+	if (!known) {
+		measure_portals(timeout);
 	}
+}
 
-	measure_portals(timeout);
+skynet_multiportal::~skynet_multiportal()
+{
+	stop_probes();
+	if (shared_mapping) {
+		munmap(shared_mapping, shared_size);
+	}
 }
 
 bool skynet_multiportal::measure_portals(std::chrono::milliseconds timeout)
 {
-	// each portal is tried in parallel, and data is filled
-	// in as results come in.
-	// once there is both an upload and download portal known to work,
-	// the constructor returns.
+	std::unique_lock<std::mutex> lock(probe_mutex);
+	if (probe_threads.empty()) {
+		lock.unlock();
+		start_probes();
+		lock.lock();
+	}
+	unsigned long downloads = probe_successes[download_kind];
+	unsigned long uploads = probe_successes[upload_kind];
+	queue_probe_round();
+	probe_changed.notify_all();
 
-	std::unique_lock<std::mutex> lock(mutex);
-	std::condition_variable transferred;
-	std::shared_ptr<std::pair<bool,bool>> transferred_successfully(new std::pair<bool,bool>(false, false));
+	// false if timeout is hit without success
+	return probe_changed.wait_for(
+		lock, timeout, [&] {
+			return probe_successes[download_kind] > downloads && probe_successes[upload_kind] > uploads;
+		}
+	);
+}
+
+void skynet_multiportal::start_probes()
+{
+	stop_probes();
+	std::lock_guard<std::mutex> lock(probe_mutex);
+	next_probe_round = std::chrono::steady_clock::now() + probes.interval;
+	for (unsigned index = 0; index < probes.workers; ++ index) {
+		probe_threads.emplace_back(&skynet_multiportal::probe_worker, this);
+	}
+}
 
-	std::string filename = "test";
-	std::string data; data.reserve(1024); data.resize(1024);
+void skynet_multiportal::stop_probes()
+{
+	std::vector<std::thread> threads;
 	{
-		std::random_device rd;
-		std::uniform_int_distribution<char> dist(-128,127);
-		for (char & d : data) {
-			d = dist(rd);
+		std::lock_guard<std::mutex> lock(probe_mutex);
+		probes_stopping = true;
+		for (auto & transfer : probe_transfers) {
+			transfer->cancel();
 		}
+		probe_changed.notify_all();
+		threads.swap(probe_threads);
+	}
+	for (auto & thread : threads) {
+		thread.join();
 	}
+	std::lock_guard<std::mutex> lock(probe_mutex);
+	probe_queue.clear();
+	probes_stopping = false;
+}
 
+void skynet_multiportal::queue_probe_round()
+{
+	for (auto * portal : *std::atomic_load(&snapshot)) {
+		if (!probing.count(portal) && std::find(probe_queue.begin(), probe_queue.end(), portal) == probe_queue.end()) {
+			probe_queue.push_back(portal);
+		}
+	}
+	if (probes.interval.count()) {
+		next_probe_round = std::chrono::steady_clock::now() + probes.interval;
+	}
+}
 
-	for (auto & portal_entry : portals) {
-		auto & portal = portal_entry.second;
-		
-		std::thread([this, &portal, timeout, data, &transferred, transferred_successfully]() {
-			auto transfer = begin_transfer(download, portal.portal);
-	
-			skynet downloader(portal.portal);
-			try {
-				auto result = downloader.download("sia://AAA2s82WUW1c73RYIcAb3PnBPHcFdHZ7XfleMkrDnueCXQ/test", {}, timeout);
-				end_transfer(transfer, result.filename.size() + result.data.size());
-				std::unique_lock<std::mutex> lock(mutex);
-				transferred_successfully->first = true;
-				transferred.notify_all();
-			} catch (...) {
-				end_transfer(transfer, 1);
-			}
-		}).detach();
-		std::thread([this, &portal, timeout, data, &transferred, transferred_successfully, filename]() {
-			auto transfer = begin_transfer(upload, portal.portal);
-			skynet uploader(portal.portal);
-			try {
-				uploader.upload(filename, data, {}, timeout);
-				end_transfer(transfer, filename.size() + data.size());
-				std::unique_lock<std::mutex> lock(mutex);
-				transferred_successfully->second = true;
-				transferred.notify_all();
-			} catch (...) {
-				end_transfer(transfer, 1);
+void skynet_multiportal::probe_worker()
+{
+	std::unique_lock<std::mutex> lock(probe_mutex);
+	while (!probes_stopping) {
+		if (probe_queue.empty()) {
+			if (!probes.interval.count()) {
+				probe_changed.wait(lock);
+			} else if (std::chrono::steady_clock::now() >= next_probe_round) {
+				queue_probe_round();
+			} else {
+				probe_changed.wait_until(lock, next_probe_round);
 			}
-		}).detach();
+			continue;
+		}
+		portal_metrics * portal = probe_queue.front();
+		probe_queue.pop_front();
+		probing.insert(portal);
+		lock.unlock();
+		probe(*portal);
+		lock.lock();
+		probing.erase(portal);
 	}
+}
 
-	// false if timeout is hit without success, hopefully
-	return transferred.wait_for(
-		lock, timeout, [&] {
-			return transferred_successfully->first && transferred_successfully->second;
+void skynet_multiportal::probe(portal_metrics & portal)
+{
+	static std::string const fallback_skylink = "sia://AAA2s82WUW1c73RYIcAb3PnBPHcFdHZ7XfleMkrDnueCXQ/test";
+	thread_local std::minstd_rand random(std::random_device{}());
+
+	// runs one transfer so that stop_probes can cancel it
+	using transfer_body = std::function<void(transfer &, std::shared_ptr<skynet::cancellation>, std::function<void(std::exception_ptr)>)>;
+	auto run = [&](transfer_kind kind, transfer_body begin) {
+		auto cancel = std::make_shared<skynet::cancellation>();
+		{
+			std::lock_guard<std::mutex> lock(probe_mutex);
+			if (probes_stopping) { return false; }
+			probe_transfers.insert(cancel);
 		}
-	);
+		if (!reserve_slot(portal, kind)) {
+			std::lock_guard<std::mutex> lock(probe_mutex);
+			probe_transfers.erase(cancel);
+			return false;
+		}
+		transfer handle = start_transfer(kind, portal);
+		std::promise<std::exception_ptr> done;
+		begin(handle, cancel, [&done](std::exception_ptr error) {
+			done.set_value(error);
+		});
+		std::exception_ptr error = done.get_future().get();
+		{
+			std::lock_guard<std::mutex> lock(probe_mutex);
+			probe_transfers.erase(cancel);
+		}
+		return !error;
+	};
+
+	for (size_t size : probes.sizes) {
+		std::vector<uint8_t> data(size);
+		for (auto & byte : data) {
+			byte = random();
+		}
+
+		std::string skylink;
+		skynet::request_timing upload_timing;
+		bool uploaded = run(upload_kind, [&](transfer & handle, std::shared_ptr<skynet::cancellation> cancel, std::function<void(std::exception_ptr)> done) {
+			skynet(handle.portal).async_upload(skynet::upload_data::borrowed("probe", data.data(), data.size()), [&, cancel, done](std::string const * result, std::exception_ptr error) {
+				if (result) {
+					skylink = *result;
+					end_transfer(handle, data.size(), upload_timing);
+				} else if (cancel->cancelled()) {
+					cancel_transfer(handle);
+				} else {
+					fail_transfer(handle, error);
+				}
+				done(error);
+			}, probes.timeout, cancel, &upload_timing);
+		});
+
+		// without a fresh upload, fetch a known file
+		std::string target = uploaded ? skylink : fallback_skylink;
+		size_t expected = uploaded ? data.size() : 0;
+		size_t received = 0;
+		bool downloaded = run(download_kind, [&](transfer & handle, std::shared_ptr<skynet::cancellation> cancel, std::function<void(std::exception_ptr)> done) {
+			skynet(handle.portal).async_download(target, {}, [&](uint8_t const * chunk, size_t size) {
+				first_byte(handle);
+				if (expected && (received + size > expected || memcmp(chunk, data.data() + received, size) != 0)) {
+					throw std::runtime_error("Probe download does not match upload");
+				}
+				received += size;
+			}, [&, cancel, done](skynet::response * result, std::exception_ptr error) {
+				if (result && (!expected || received == expected)) {
+					end_transfer(handle, received, result->timing);
+				} else {
+					if (!error) { error = std::make_exception_ptr(std::runtime_error("Probe download was short")); }
+					if (cancel->cancelled()) {
+						cancel_transfer(handle);
+					} else {
+						fail_transfer(handle, error);
+					}
+				}
+				done(error);
+			}, probes.timeout, cancel);
+		});
+
+		std::lock_guard<std::mutex> lock(probe_mutex);
+		if (uploaded) { ++ probe_successes[upload_kind]; }
+		if (downloaded) { ++ probe_successes[download_kind]; }
+		probe_changed.notify_all();
+		if (probes_stopping) { break; }
+	}
 }
 
 void skynet_multiportal::ensure_portal(skynet::portal_options portal)
 {
 	std::lock_guard<std::mutex> lock(mutex);
-	portals[portal.url].portal = portal;
+	auto found = portals.find(portal.url);
+	if (found != portals.end()) {
+		std::lock_guard<std::mutex> portal_lock(found->second.mutex);
+		found->second.portal = portal;
+		return;
+	}
+	portal_metrics & entry = portals[portal.url];
+	entry.portal = portal;
+	entry.slots = slots_per_portal;
+	if (shared_mapping) {
+		attach_shared(entry, portal.url);
+	}
+
+	auto next = std::make_shared<std::vector<portal_metrics *>>(*std::atomic_load(&snapshot));
+	next->push_back(&entry);
+	std::atomic_store(&snapshot, std::shared_ptr<std::vector<portal_metrics *> const>(next));
+}
+
+void skynet_multiportal::set_portal_slots(std::string const & url, unsigned slots)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = portals.find(url);
+	if (found == portals.end()) { return; }
+	found->second.slots = slots;
+	// more room may wake waiters
+	for (auto & condition : transferred) {
+		condition.notify_all();
+	}
 }
 
 skynet_multiportal::portal_metrics const & skynet_multiportal::metrics(std::string url)
@@ -91,63 +308,1088 @@ skynet_multiportal::portal_metrics const & skynet_multiportal::metrics(std::stri
 	return portals[url];
 }
 
+std::vector<skynet::portal_options> skynet_multiportal::ranked_portals(transfer_kind kind, size_t count)
+{
+	auto current = std::atomic_load(&snapshot);
+	double unknown_first_byte, unknown_speed;
+	unknown_estimates(*current, kind, unknown_first_byte, unknown_speed);
+	std::vector<std::pair<double, portal_metrics *>> ranked;
+	for (auto * portal : *current) {
+		auto & metric = portal->metrics[kind];
+		ranked.emplace_back(metric.reliability / std::max(expected_seconds(metric, kind, unknown_first_byte, unknown_speed), 1e-6), portal);
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), [](auto const & left, auto const & right) {
+		return left.first > right.first;
+	});
+	std::vector<skynet::portal_options> result;
+	for (size_t index = 0; index < ranked.size() && index < count; ++ index) {
+		std::lock_guard<std::mutex> lock(ranked[index].second->mutex);
+		result.emplace_back(ranked[index].second->portal);
+	}
+	return result;
+}
+
 skynet_multiportal::transfer skynet_multiportal::begin_transfer(transfer_kind kind, skynet::portal_options portal)
 {
-	if (portal.url.size()) {
-		ensure_portal(portal);
+	if (!portal.url.size()) {
+		transfer result;
+		acquire_transfer(kind, {}, std::chrono::steady_clock::time_point::max(), result);
+		return result;
 	}
-	std::unique_lock<std::mutex> lock(mutex);
-	if (portal.url.size()) {
-		portals[portal.url].metrics[kind].mutex.lock();
-		return {
-			kind,
-			portal,
-			std::chrono::steady_clock::now()
-		};
+
+	ensure_portal(portal);
+	portal_metrics * chosen;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		chosen = &portals[portal.url];
 	}
-	portal_metrics * best_portal = 0;
-	portal_metrics::metric * best_metric = 0;
-	double best_speed = 0;
-	while (!best_portal) {
-		for (auto & portal_entry : portals) {
-			auto & portal = portal_entry.second;
-			auto & metric = portal.metrics[kind];
-			if (metric.mutex.try_lock()) {
-				if (!best_speed || metric.speed > best_speed) {
-					if (best_portal) {
-						best_metric->mutex.unlock();
-					}
-					best_portal = &portal;
-					best_metric = &metric;
-					best_speed = metric.speed;
-				} else {
-					metric.mutex.unlock();
-				}
-			}
-		}
-		if (!best_portal) {
+	if (!reserve_slot(*chosen, kind)) {
+		std::unique_lock<std::mutex> lock(mutex);
+		++ waiting[kind];
+		while (!reserve_slot(*chosen, kind)) {
 			transferred[kind].wait(lock);
 		}
+		-- waiting[kind];
+	}
+	return start_transfer(kind, *chosen);
+}
+
+bool skynet_multiportal::acquire_transfer(transfer_kind kind, std::vector<portal_metrics const *> const & exclude, std::chrono::steady_clock::time_point deadline, transfer & result)
+{
+	// the fast path takes no lock shared between portals
+	portal_metrics * chosen = select_portal(kind, exclude);
+	if (!chosen) {
+		// everything is full.  end_transfer frees a slot before checking for
+		// waiters, and waiters count themselves before looking again, so a
+		// freed slot is always either seen or notified.  open circuits end
+		// without notice, so waiting is bounded by the shortest back-off.
+		std::unique_lock<std::mutex> lock(mutex);
+		++ waiting[kind];
+		while (!(chosen = select_portal(kind, exclude, true))) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline || portals.size() <= exclude.size()) { break; }
+			transferred[kind].wait_until(lock, std::min(deadline, now + circuits.initial_backoff));
+		}
+		-- waiting[kind];
 	}
+	if (!chosen) { return false; }
+	result = start_transfer(kind, *chosen);
+	return true;
+}
+
+skynet_multiportal::transfer skynet_multiportal::start_transfer(transfer_kind kind, portal_metrics & portal)
+{
+	std::lock_guard<std::mutex> lock(portal.mutex);
 	return {
 		kind,
-		best_portal->portal,
-		std::chrono::steady_clock::now()
+		portal.portal,
+		std::chrono::steady_clock::now(),
+		&portal
+	};
+}
+
+bool skynet_multiportal::reserve_slot(portal_metrics & portal, transfer_kind kind)
+{
+	auto & in_flight = portal.metrics[kind].in_flight;
+	unsigned current = in_flight;
+	do {
+		if (current >= portal.slots) { return false; }
+	} while (!in_flight.compare_exchange_weak(current, current + 1));
+	return true;
+}
+
+void skynet_multiportal::release_slot(portal_metrics & portal, transfer_kind kind, bool locked)
+{
+	-- portal.metrics[kind].in_flight;
+
+	if (!waiting[kind]) { return; }
+	if (locked) {
+		transferred[kind].notify_all();
+	} else {
+		std::lock_guard<std::mutex> lock(mutex);
+		transferred[kind].notify_all();
+	}
+}
+
+bool skynet_multiportal::admit(portal_metrics & portal)
+{
+	// open circuits are tried once their back-off is over; half open ones have a trial running
+	int circuit = portal.circuit;
+	return circuit == circuit_closed || (circuit == circuit_open && std::chrono::steady_clock::now().time_since_epoch().count() >= portal.retry_time);
+}
+
+void skynet_multiportal::record_circuit(portal_metrics & portal, outcome result)
+{
+	std::lock_guard<std::mutex> lock(portal.mutex);
+	auto reopen = [&](std::chrono::steady_clock::duration backoff) {
+		portal.backoff = std::min(backoff, circuits.max_backoff);
+		portal.retry_time = (std::chrono::steady_clock::now() + portal.backoff).time_since_epoch().count();
+		portal.circuit = circuit_open;
+	};
+	switch (result) {
+	case succeeded:
+	case rejected:
+		// the portal answered
+		portal.consecutive_failures = 0;
+		portal.backoff = {};
+		portal.circuit = circuit_closed;
+		break;
+	case failed:
+		++ portal.consecutive_failures;
+		if (portal.circuit == circuit_half_open) {
+			reopen(portal.backoff * 2);
+		} else if (portal.circuit == circuit_closed && portal.consecutive_failures >= circuits.failure_threshold) {
+			reopen(circuits.initial_backoff);
+		}
+		break;
+	case cancelled:
+		// says nothing either way; let another trial through
+		if (portal.circuit == circuit_half_open) {
+			portal.circuit = circuit_open;
+		}
+		break;
+	}
+}
+
+skynet_multiportal::portal_metrics * skynet_multiportal::select_portal(transfer_kind kind, std::vector<portal_metrics const *> const & exclude, bool locked)
+{
+	auto current = std::atomic_load(&snapshot);
+
+	// portals never measured are weighted like an average one, so they get tried
+	double unknown_first_byte, unknown_speed;
+	unknown_estimates(*current, kind, unknown_first_byte, unknown_speed);
+
+	thread_local std::minstd_rand random(std::random_device{}());
+	std::vector<std::pair<double, portal_metrics *>> candidates;
+	candidates.reserve(current->size());
+	while (true) {
+		// a transfer waits behind those in flight
+		candidates.clear();
+		double total = 0;
+		for (auto * portal : *current) {
+			auto & metric = portal->metrics[kind];
+			unsigned in_flight = metric.in_flight;
+			if (in_flight >= portal->slots || std::find(exclude.begin(), exclude.end(), portal) != exclude.end()) { continue; }
+			if (!admit(*portal)) { continue; }
+			double weight = metric.reliability / (std::max(expected_seconds(metric, kind, unknown_first_byte, unknown_speed), 1e-6) * (in_flight + 1));
+			total += weight;
+			candidates.emplace_back(total, portal);
+		}
+		if (candidates.empty()) { return nullptr; }
+
+		double pick = std::uniform_real_distribution<double>(0, total)(random);
+		auto chosen = std::upper_bound(candidates.begin(), candidates.end(), pick, [](double pick, auto const & candidate) {
+			return pick < candidate.first;
+		});
+		if (chosen == candidates.end()) { -- chosen; }
+		// another thread may have taken the last slot, or the trial of a
+		// circuit, since; look again
+		portal_metrics & portal = *chosen->second;
+		if (!reserve_slot(portal, kind)) { continue; }
+		int circuit = portal.circuit;
+		if (circuit == circuit_closed) { return &portal; }
+		if (circuit == circuit_open && admit(portal) && portal.circuit.compare_exchange_strong(circuit, circuit_half_open)) {
+			return &portal;
+		}
+		release_slot(portal, kind, locked);
+	}
+}
+
+void skynet_multiportal::unknown_estimates(std::vector<portal_metrics *> const & portals, transfer_kind kind, double & first_byte, double & speed)
+{
+	double known_first_byte = 0, known_speed = 0;
+	size_t first_byte_count = 0, speed_count = 0;
+	for (auto * portal : portals) {
+		auto & metric = portal->metrics[kind];
+		double value = metric.first_byte;
+		if (value > 0) {
+			known_first_byte += value;
+			++ first_byte_count;
+		}
+		value = metric.speed;
+		if (value > 0) {
+			known_speed += value;
+			++ speed_count;
+		}
+	}
+	first_byte = first_byte_count ? known_first_byte / first_byte_count : 0;
+	speed = speed_count ? known_speed / speed_count : 1;
+}
+
+double skynet_multiportal::expected_seconds(portal_metrics::metric const & metric, transfer_kind kind, double unknown_first_byte, double unknown_speed)
+{
+	double first_byte = metric.first_byte;
+	double speed = metric.speed;
+	return (first_byte > 0 ? first_byte : unknown_first_byte) + typical_size[kind] / (speed > 0 ? speed : unknown_speed);
+}
+
+skynet::response skynet_multiportal::download_hedged(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, std::chrono::milliseconds hedge_delay, std::chrono::milliseconds timeout)
+{
+	// attempts are shared with the transfer thread, which may still be
+	// finishing one when this returns
+	struct attempt {
+		transfer handle;
+		std::shared_ptr<skynet::cancellation> cancel = std::make_shared<skynet::cancellation>();
+		std::atomic<bool> started{false};
+		std::vector<uint8_t> data;
+		bool done = false;
+		skynet::response result;
+		std::exception_ptr error;
+	};
+	struct hedge {
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::list<attempt> attempts;
 	};
+	auto state = std::make_shared<hedge>();
+
+	auto start = [&](transfer handle) {
+		state->attempts.emplace_back();
+		attempt & current = state->attempts.back();
+		current.handle = handle;
+		skynet(handle.portal).async_download(skylink, ranges, [state, &current](uint8_t const * data, size_t size) {
+			current.data.insert(current.data.end(), data, data + size);
+			if (!current.started) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				current.handle.first_byte_time = std::chrono::steady_clock::now();
+				current.started = true;
+				state->changed.notify_all();
+			}
+		}, [state, &current](skynet::response * result, std::exception_ptr error) {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			current.done = true;
+			if (result) {
+				current.result = std::move(*result);
+			}
+			current.error = error;
+			state->changed.notify_all();
+		}, timeout, current.cancel);
+	};
+
+	transfer first = begin_transfer(download_kind);
+	std::chrono::steady_clock::duration delay = hedge_delay;
+	if (delay == delay.zero()) {
+		auto & metric = first.entry->metrics[download_kind];
+		std::lock_guard<std::mutex> metric_lock(metric.mutex);
+		delay = metric.time_to_first_byte.quantile(0.95);
+		if (delay == delay.zero()) { delay = std::chrono::seconds(1); }
+	}
+	std::unique_lock<std::mutex> lock(state->mutex);
+	start(first);
+	auto hedge_time = std::chrono::steady_clock::now() + delay;
+	bool hedged = false;
+	attempt * winner = nullptr;
+	while (true) {
+		bool all_failed = true;
+		bool any_started = false;
+		for (auto & current : state->attempts) {
+			if (current.done && !current.error) { winner = &current; }
+			if (!current.done) { all_failed = false; }
+			if (current.started) { any_started = true; }
+		}
+		if (winner) { break; }
+		if (!hedged && (all_failed || (!any_started && std::chrono::steady_clock::now() >= hedge_time))) {
+			hedged = true;
+			lock.unlock();
+			portal_metrics * next = select_portal(download_kind, {first.entry});
+			transfer second;
+			if (next) { second = start_transfer(download_kind, *next); }
+			lock.lock();
+			if (next) {
+				start(second);
+				continue;
+			}
+		}
+		if (all_failed) { break; }
+		if (hedged) {
+			state->changed.wait(lock);
+		} else {
+			state->changed.wait_until(lock, hedge_time);
+		}
+	}
+
+	// the loser is cancelled and waited for, so both are recorded here
+	for (auto & current : state->attempts) {
+		if (!current.done) { current.cancel->cancel(); }
+	}
+	state->changed.wait(lock, [&] {
+		for (auto & current : state->attempts) {
+			if (!current.done) { return false; }
+		}
+		return true;
+	});
+	lock.unlock();
+	for (auto & current : state->attempts) {
+		if (&current == winner) {
+			end_transfer(current.handle, current.result.filename.size() + current.data.size(), current.result.timing);
+		} else if (current.cancel->cancelled()) {
+			cancel_transfer(current.handle);
+		} else {
+			fail_transfer(current.handle, current.error);
+		}
+	}
+
+	// the transfer thread may drop the last reference to state, so take
+	// everything out that is used after returning
+	std::exception_ptr error = state->attempts.back().error;
+	for (auto & current : state->attempts) {
+		current.error = nullptr;
+	}
+	if (!winner) {
+		std::rethrow_exception(error);
+	}
+	winner->result.data = std::move(winner->data);
+	return std::move(winner->result);
+}
+
+void skynet_multiportal::failover(transfer_kind kind, std::chrono::milliseconds timeout, size_t max_attempts, std::function<unsigned long(transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing)> attempt)
+{
+	auto deadline = timeout.count() ? std::chrono::steady_clock::now() + timeout : std::chrono::steady_clock::time_point::max();
+	std::vector<portal_metrics const *> tried;
+	std::exception_ptr error;
+	transfer handle;
+	while (tried.size() < max_attempts && acquire_transfer(kind, tried, deadline, handle)) {
+		tried.push_back(handle.entry);
+		std::chrono::milliseconds remaining(0);
+		if (timeout.count()) {
+			remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0) {
+				cancel_transfer(handle);
+				break;
+			}
+		}
+		try {
+			skynet::request_timing timing;
+			unsigned long amount = attempt(handle, remaining, timing);
+			end_transfer(handle, amount, timing);
+			return;
+		} catch (abort_failover & abort) {
+			// the caller gave up, which says nothing about the portal
+			cancel_transfer(handle);
+			std::rethrow_exception(abort.error);
+		} catch (...) {
+			error = std::current_exception();
+			fail_transfer(handle, error);
+		}
+	}
+	if (error) { std::rethrow_exception(error); }
+	throw std::runtime_error(timeout.count() ? "No portal was available before the timeout" : "No portal was available");
+}
+
+skynet::response skynet_multiportal::query(std::string const & skylink, std::chrono::milliseconds timeout)
+{
+	skynet::response result;
+	failover(download_kind, timeout, ~size_t(0), [&](transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing) {
+		result = skynet(handle.portal).query(skylink, timeout);
+		timing = result.timing;
+		return 0;
+	});
+	return result;
+}
+
+skynet::response skynet_multiportal::download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, std::chrono::milliseconds timeout)
+{
+	std::vector<uint8_t> data;
+	auto result = download(skylink, ranges, [&data](uint8_t const * chunk, size_t size) {
+		data.insert(data.end(), chunk, chunk + size);
+	}, timeout);
+	result.data = std::move(data);
+	return result;
+}
+
+skynet::response skynet_multiportal::download(std::string const & skylink, std::vector<std::pair<size_t, size_t>> const & ranges, skynet::sink const & output, std::chrono::milliseconds timeout)
+{
+	skynet::response result;
+	size_t received = 0;
+	size_t resumed = 0; // bytes received before the attempt that finished
+	size_t first = 0; // the first of ranges that attempt asked for
+	failover(download_kind, timeout, ~size_t(0), [&](transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing) {
+		// ask for what is left after the bytes already passed on, which
+		// arrive in the order of the ranges
+		std::vector<std::pair<size_t, size_t>> remaining;
+		size_t skip = received;
+		size_t index = 0;
+		if (!ranges.size() && skip) {
+			remaining.emplace_back(skip, skynet::to_end);
+		}
+		for (; index < ranges.size(); ++ index) {
+			auto & range = ranges[index];
+			if (skip >= range.second) {
+				skip -= range.second;
+				continue;
+			}
+			break;
+		}
+		for (size_t later = index; later < ranges.size(); ++ later) {
+			auto & range = ranges[later];
+			remaining.emplace_back(range.first + skip, range.second == skynet::to_end ? range.second : range.second - skip);
+			skip = 0;
+		}
+		size_t start = received;
+		resumed = start;
+		first = index;
+		if (ranges.size() && !remaining.size()) { return 0ul; }
+
+		// the sink runs on this thread, so a slow one holds up no other transfer
+		std::exception_ptr aborted;
+		skynet::sink counted = [&](uint8_t const * data, size_t size) {
+			first_byte(handle);
+			try {
+				output(data, size);
+			} catch (...) {
+				aborted = std::current_exception();
+				throw;
+			}
+			received += size;
+		};
+		try {
+			result = skynet(handle.portal).perform_download(skylink, remaining, &counted, timeout);
+		} catch (...) {
+			if (aborted) { throw abort_failover{aborted}; }
+			throw;
+		}
+		timing = result.timing;
+		return (unsigned long)(received - start);
+	});
+	if (resumed) {
+		// describe the whole request rather than its last piece
+		std::vector<std::pair<size_t, size_t>> whole;
+		if (!ranges.size()) {
+			whole.emplace_back(0, received);
+		} else {
+			whole.assign(ranges.begin(), ranges.begin() + first);
+			size_t skipped = resumed;
+			for (auto & range : whole) {
+				skipped -= range.second;
+			}
+			for (auto & range : result.dataranges) {
+				whole.emplace_back(range.first - skipped, range.second + skipped);
+				skipped = 0;
+			}
+		}
+		result.skylink = skylink;
+		result.dataranges = std::move(whole);
+		result.metadata.len = received;
+	}
+	return result;
+}
+
+skynet::response skynet_multiportal::download_file(std::string const & path, std::string const & skylink, std::chrono::milliseconds timeout)
+{
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+
+	if (!file.is_open()) { throw std::runtime_error("Failed to open " + path); }
+
+	auto result = download(skylink, {}, [&](uint8_t const * data, size_t size) {
+		file.write((char const *)data, size);
+		if (file.fail()) { throw std::runtime_error("Failed to write contents of " + path); }
+	}, timeout);
+
+	file.close();
+
+	if (file.fail()) { throw std::runtime_error("Failed to write contents of " + path); }
+
+	return result;
+}
+
+size_t uploadSize(skynet::upload_data const & file)
+{
+	if (file.reader) { return file.reader_size == skynet::upload_data::unknown_size ? 0 : file.reader_size; }
+	return file.span ? file.span_size : file.data.size();
+}
+
+skynet::upload_data uploadAttempt(skynet::upload_data const & file)
+{
+	// each attempt refers to the caller's data rather than copying it
+	if (file.reader) { return file; }
+	if (file.span) {
+		auto result = skynet::upload_data::borrowed(file.filename, file.span, file.span_size, file.contenttype);
+		result.span_owner = file.span_owner;
+		return result;
+	}
+	return skynet::upload_data::borrowed(file.filename, file.data.data(), file.data.size(), file.contenttype);
+}
+
+std::string skynet_multiportal::upload(skynet::upload_data const & file, std::chrono::milliseconds timeout)
+{
+	std::string skylink;
+	failover(upload_kind, timeout, file.reader ? 1 : ~size_t(0), [&](transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing) {
+		skylink = skynet(handle.portal).upload(uploadAttempt(file), timeout, &timing);
+		return (unsigned long)uploadSize(file);
+	});
+	return skylink;
+}
+
+std::string skynet_multiportal::upload(std::string const & filename, std::vector<skynet::upload_data> const & files, std::chrono::milliseconds timeout)
+{
+	bool replayable = true;
+	size_t size = 0;
+	for (auto & file : files) {
+		if (file.reader) { replayable = false; }
+		size += uploadSize(file);
+	}
+	std::string skylink;
+	failover(upload_kind, timeout, replayable ? ~size_t(0) : 1, [&](transfer & handle, std::chrono::milliseconds timeout, skynet::request_timing & timing) {
+		std::vector<skynet::upload_data> attempt;
+		for (auto & file : files) {
+			attempt.emplace_back(uploadAttempt(file));
+		}
+		skylink = skynet(handle.portal).upload(filename, std::move(attempt), timeout, &timing);
+		return (unsigned long)size;
+	});
+	return skylink;
+}
+
+std::string skynet_multiportal::upload_file(std::string const & path, std::string filename, std::chrono::milliseconds timeout)
+{
+	if (!filename.size()) {
+		filename = path;
+	}
+
+	return upload(skynet::upload_data::mapped(filename, path), timeout);
+}
+
+void skynet_multiportal::first_byte(transfer & transfer)
+{
+	if (transfer.first_byte_time == std::chrono::steady_clock::time_point()) {
+		transfer.first_byte_time = std::chrono::steady_clock::now();
+	}
 }
 
 void skynet_multiportal::end_transfer(skynet_multiportal::transfer transfer, unsigned long amount_successfully_transferred)
+{
+	finish_transfer(transfer, succeeded, amount_successfully_transferred);
+}
+
+void skynet_multiportal::end_transfer(skynet_multiportal::transfer transfer, unsigned long amount_successfully_transferred, skynet::request_timing const & timing)
+{
+	// a cache hit made no request
+	finish_transfer(transfer, succeeded, amount_successfully_transferred, timing.total.count() ? &timing : nullptr);
+}
+
+void skynet_multiportal::fail_transfer(skynet_multiportal::transfer transfer, std::exception_ptr error)
+{
+	outcome result = failed;
+	if (error) {
+		try {
+			std::rethrow_exception(error);
+		} catch (skynet::http_error const & http) {
+			if (http.status >= 400 && http.status < 500 && http.status != 408 && http.status != 429) {
+				result = rejected;
+			}
+		} catch (...) { }
+	}
+	finish_transfer(transfer, result, 0);
+}
+
+void skynet_multiportal::cancel_transfer(skynet_multiportal::transfer transfer)
+{
+	finish_transfer(transfer, cancelled, 0);
+}
+
+void skynet_multiportal::finish_transfer(transfer const & transfer, outcome result, unsigned long amount, skynet::request_timing const * timing)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	// a transfer not from begin_transfer holds no slot, but is still recorded
+	portal_metrics * portal = transfer.entry;
+	if (!portal) {
+		std::lock_guard<std::mutex> lock(mutex);
+		portal = &portals[transfer.portal.url];
+	}
+	portal_metrics::metric & metric = portal->metrics[transfer.kind];
+
+	// split the transfer into its fixed cost and its body.  curl's timing is the
+	// most exact, then the first byte as the caller noted it.  an upload's reply
+	// only starts once its body is sent, so its fixed cost is connecting, which
+	// is unknown on a reused connection.
+	auto elapsed = now - transfer.start_time;
+	bool got_first_byte = timing || transfer.first_byte_time != std::chrono::steady_clock::time_point();
+	std::chrono::steady_clock::duration until_first_byte = elapsed;
+	double fixed_seconds = 0; // 0 when unknown
+	double body_seconds = std::chrono::duration<double>(elapsed).count();
+	if (timing) {
+		until_first_byte = timing->start_transfer;
+		std::chrono::microseconds fixed = transfer.kind == upload_kind ? std::max(timing->connect, timing->app_connect) : timing->start_transfer;
+		if (fixed.count()) { fixed_seconds = std::chrono::duration<double>(fixed).count(); }
+		body_seconds = std::chrono::duration<double>(timing->total - fixed).count();
+	} else if (got_first_byte) {
+		until_first_byte = transfer.first_byte_time - transfer.start_time;
+		fixed_seconds = std::max(std::chrono::duration<double>(until_first_byte).count(), 1e-6);
+		body_seconds = std::chrono::duration<double>(now - transfer.first_byte_time).count();
+	}
+	body_seconds = std::max(body_seconds, 1e-6);
+
+	double speed = 0;
+	{
+		std::lock_guard<std::mutex> lock(metric.mutex);
+
+		age_metric(metric, now);
+
+		// a cancelled transfer that never got data still says the first byte takes at least this long
+		if (got_first_byte || result == succeeded || result == cancelled) {
+			metric.time_to_first_byte.add(until_first_byte);
+		}
+
+		if (result == succeeded) {
+			metric.latency.add(elapsed);
+			if (fixed_seconds) {
+				metric.first_byte_weight += 1;
+				metric.first_byte = metric.first_byte + (fixed_seconds - metric.first_byte) / metric.first_byte_weight;
+			}
+			// queries move no data and say nothing of speed.  samples weigh
+			// their duration, so short bodies, mostly noise, count for little.
+			if (amount) {
+				speed = amount / body_seconds;
+				metric.speed_weight += body_seconds;
+				metric.speed = metric.speed + (speed - metric.speed) * body_seconds / metric.speed_weight;
+			}
+		}
+		if (result == succeeded || result == failed) {
+			metric.reliability_weight += 1;
+			metric.reliability = metric.reliability + ((result == succeeded ? 1 : 0) - metric.reliability) / metric.reliability_weight;
+		}
+	}
+	if (result == succeeded && amount) {
+		// sizes move a sixteenth of the way per transfer
+		auto & typical = typical_size[transfer.kind];
+		double size = typical;
+		while (!typical.compare_exchange_weak(size, size ? size + (amount - size) / 16 : amount)) { }
+	}
+	switch (result) {
+	case succeeded:
+		metric.data += amount;
+		++ metric.successes;
+		break;
+	case failed:
+	case rejected:
+		++ metric.errors;
+		break;
+	case cancelled:
+		++ metric.cancellations;
+		break;
+	}
+
+	// fold the transfer into the shared file.  each sample moves the shared
+	// averages a tenth of the way, or further when they are stale, and bodies
+	// under a tenth of a second move the speed less.
+	if (shared_record * record = portal->shared) {
+		auto & shared = record->metrics[transfer.kind];
+		int64_t time = systemNanoseconds();
+		double stale = 1 - std::exp2(-std::chrono::duration<double>(std::chrono::nanoseconds(time - shared.updated)) / metric_half_life);
+		double weight = std::max(0.1, stale);
+		if (speed) {
+			blendShared(shared.speed, speed, shared.speed ? weight * std::min(1.0, body_seconds / 0.1) : 1);
+		}
+		if (result == succeeded && fixed_seconds) {
+			blendShared(shared.first_byte, fixed_seconds, shared.first_byte ? weight : 1);
+		}
+		if (result == succeeded || result == failed) {
+			blendShared(shared.failure_rate, result == succeeded ? 0 : 1, weight);
+		}
+		shared.updated = time;
+		switch (result) {
+		case succeeded:
+			shared.data += amount;
+			++ shared.successes;
+			break;
+		case failed:
+		case rejected:
+			++ shared.errors;
+			break;
+		case cancelled:
+			++ shared.cancellations;
+			break;
+		}
+	}
+
+	record_circuit(*portal, result);
+
+	if (!transfer.entry) { return; }
+	release_slot(*portal, transfer.kind);
+}
+
+void skynet_multiportal::age_metric(portal_metrics::metric & metric, std::chrono::steady_clock::time_point now)
+{
+	// age everything by the time since the last sample
+	double keep = 1;
+	if (metric.last_sample != std::chrono::steady_clock::time_point()) {
+		keep = std::exp2(-std::chrono::duration<double>(now - metric.last_sample) / metric_half_life);
+	}
+	metric.last_sample = now;
+	metric.time_to_first_byte.decay(keep);
+	metric.latency.decay(keep);
+	metric.speed_weight *= keep;
+	metric.first_byte_weight *= keep;
+	metric.reliability_weight *= keep;
+}
+
+void skynet_multiportal::merge_metric(portal_metrics::metric & metric, double speed, double speed_weight, double first_byte, double first_byte_weight, double reliability, double reliability_weight, std::chrono::steady_clock::duration age)
+{
+	age_metric(metric, std::chrono::steady_clock::now());
+	double keep = std::exp2(-std::chrono::duration<double>(age) / metric_half_life);
+	speed_weight *= keep;
+	first_byte_weight *= keep;
+	reliability_weight *= keep;
+	if (speed_weight > 0) {
+		metric.speed_weight += speed_weight;
+		metric.speed = metric.speed + (speed - metric.speed) * speed_weight / metric.speed_weight;
+	}
+	if (first_byte_weight > 0) {
+		metric.first_byte_weight += first_byte_weight;
+		metric.first_byte = metric.first_byte + (first_byte - metric.first_byte) * first_byte_weight / metric.first_byte_weight;
+	}
+	if (reliability_weight > 0) {
+		metric.reliability_weight += reliability_weight;
+		metric.reliability = metric.reliability + (reliability - metric.reliability) * reliability_weight / metric.reliability_weight;
+	}
+}
+
+std::string skynet_multiportal::save_metrics()
+{
+	auto now = std::chrono::steady_clock::now();
+	nlohmann::json result = {
+		{"time", std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()},
+		{"portals", nlohmann::json::array()}
+	};
+	for (auto * portal : *std::atomic_load(&snapshot)) {
+		nlohmann::json entry;
+		{
+			std::lock_guard<std::mutex> lock(portal->mutex);
+			entry["url"] = portal->portal.url;
+			entry["upload_path"] = portal->portal.uploadPath;
+			entry["file_fieldname"] = portal->portal.fileFieldname;
+			entry["directory_file_fieldname"] = portal->portal.directoryFileFieldname;
+		}
+		for (size_t kind = 0; kind < transfer_kind_count; ++ kind) {
+			auto & metric = portal->metrics[kind];
+			std::lock_guard<std::mutex> lock(metric.mutex);
+			age_metric(metric, now);
+			entry[kindNames[kind]] = {
+				{"speed", metric.speed.load()},
+				{"speed_weight", metric.speed_weight},
+				{"first_byte", metric.first_byte.load()},
+				{"first_byte_weight", metric.first_byte_weight},
+				{"reliability", metric.reliability.load()},
+				{"reliability_weight", metric.reliability_weight},
+				{"data", metric.data.load()},
+				{"successes", metric.successes.load()},
+				{"errors", metric.errors.load()},
+				{"cancellations", metric.cancellations.load()},
+				{"time_to_first_byte", storeHistogram(metric.time_to_first_byte)},
+				{"latency", storeHistogram(metric.latency)}
+			};
+		}
+		result["portals"].push_back(entry);
+	}
+	return result.dump();
+}
+
+void skynet_multiportal::restore_metrics(std::string const & saved)
+{
+	nlohmann::json value = nlohmann::json::parse(saved);
+	auto age = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(0.0,
+		std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count() - value.value("time", 0.0)
+	)));
+	double keep = std::exp2(-std::chrono::duration<double>(age) / metric_half_life);
+
+	for (auto & entry : value["portals"]) {
+		std::string url = entry["url"];
+		portal_metrics * portal = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto found = portals.find(url);
+			if (found != portals.end()) { portal = &found->second; }
+		}
+		// the options of known portals are left as they are
+		if (!portal) {
+			ensure_portal(skynet::portal_options{url, entry["upload_path"], entry["file_fieldname"], entry["directory_file_fieldname"]});
+			std::lock_guard<std::mutex> lock(mutex);
+			portal = &portals[url];
+		}
+		for (size_t kind = 0; kind < transfer_kind_count; ++ kind) {
+			if (!entry.contains(kindNames[kind])) { continue; }
+			auto & saved_metric = entry[kindNames[kind]];
+			auto & metric = portal->metrics[kind];
+			std::lock_guard<std::mutex> lock(metric.mutex);
+			merge_metric(metric, saved_metric["speed"], saved_metric["speed_weight"], saved_metric.value("first_byte", 0.0), saved_metric.value("first_byte_weight", 0.0), saved_metric["reliability"], saved_metric["reliability_weight"], age);
+			loadHistogram(metric.time_to_first_byte, saved_metric["time_to_first_byte"], keep);
+			loadHistogram(metric.latency, saved_metric["latency"], keep);
+			metric.data += saved_metric["data"].get<unsigned long long>();
+			metric.successes += saved_metric["successes"].get<unsigned long long>();
+			metric.errors += saved_metric["errors"].get<unsigned long long>();
+			metric.cancellations += saved_metric["cancellations"].get<unsigned long long>();
+		}
+	}
+}
+
+bool skynet_multiportal::share_metrics(std::string const & path)
 {
 	std::lock_guard<std::mutex> lock(mutex);
-	portal_metrics & portal = portals[transfer.portal.url];
-	portal_metrics::metric & metric = portal.metrics[transfer.kind];
-	
-	metric.data += amount_successfully_transferred;
-	metric.time += std::chrono::steady_clock::now() - transfer.start_time;
-	metric.speed = metric.data / std::chrono::duration<double>(metric.time).count();
-	metric.mutex.unlock();
-
-	transferred[transfer.kind].notify_all();
+	if (shared_mapping) { throw std::runtime_error("Metrics are already shared"); }
+
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) { throw std::runtime_error("Failed to open " + path + ": " + strerror(errno)); }
+	// processes racing to create the file all grow it to the same size
+	size_t size = sizeof(shared_header) + sharedCapacity * sizeof(shared_record);
+	struct stat stat;
+	if (fstat(fd, &stat) != 0 || ((size_t)stat.st_size < size && ftruncate(fd, size) != 0)) {
+		std::string error = strerror(errno);
+		close(fd);
+		throw std::runtime_error("Failed to size " + path + ": " + error);
+	}
+	size = std::max(size, (size_t)stat.st_size);
+	void * mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) { throw std::runtime_error("Failed to map " + path + ": " + strerror(errno)); }
+
+	uint64_t magic = 0;
+	if (!static_cast<shared_header *>(mapping)->magic.compare_exchange_strong(magic, sharedMagic) && magic != sharedMagic) {
+		munmap(mapping, size);
+		throw std::runtime_error(path + " is not a metrics file");
+	}
+	shared_mapping = mapping;
+	shared_size = size;
+
+	unsigned known = 0;
+	for (auto & entry : portals) {
+		known |= attach_shared(entry.second, entry.first);
+	}
+	return known == (1u << transfer_kind_count) - 1;
+}
+
+unsigned skynet_multiportal::attach_shared(portal_metrics & portal, std::string const & url)
+{
+	auto * records = reinterpret_cast<shared_record *>(static_cast<char *>(shared_mapping) + sizeof(shared_header));
+	size_t capacity = (shared_size - sizeof(shared_header)) / sizeof(shared_record);
+
+	// open addressing: the first free record from the hash on is claimed
+	uint64_t key = hashUrl(url);
+	shared_record * record = nullptr;
+	for (size_t probe = 0; probe < capacity && !record; ++ probe) {
+		auto & candidate = records[(key + probe) % capacity];
+		uint64_t found = 0;
+		if (candidate.key.compare_exchange_strong(found, key) || found == key) {
+			record = &candidate;
+		}
+	}
+	// a full file leaves the portal unshared
+	if (!record) { return 0; }
+
+	// what the file knows counts as one sample, as old as its last update
+	unsigned known = 0;
+	int64_t time = systemNanoseconds();
+	for (size_t kind = 0; kind < transfer_kind_count; ++ kind) {
+		auto & shared = record->metrics[kind];
+		int64_t updated = shared.updated;
+		if (!updated) { continue; }
+		double speed, first_byte, failure_rate;
+		uint64_t bits = shared.speed;
+		std::memcpy(&speed, &bits, sizeof(speed));
+		bits = shared.first_byte;
+		std::memcpy(&first_byte, &bits, sizeof(first_byte));
+		bits = shared.failure_rate;
+		std::memcpy(&failure_rate, &bits, sizeof(failure_rate));
+		auto age = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(std::max<int64_t>(0, time - updated)));
+
+		std::lock_guard<std::mutex> lock(portal.metrics[kind].mutex);
+		merge_metric(portal.metrics[kind], speed, speed > 0 ? 1 : 0, first_byte, first_byte > 0 ? 1 : 0, 1 - failure_rate, 1, age);
+		if (speed > 0) { known |= 1u << kind; }
+	}
+	portal.shared = record;
+	return known;
+}
+
+nlohmann::json storeHistogram(skynet_multiportal::decaying_histogram const & histogram)
+{
+	size_t used = skynet_multiportal::decaying_histogram::bucket_count;
+	while (used && histogram.buckets[used - 1] == 0) {
+		-- used;
+	}
+	return std::vector<double>(histogram.buckets, histogram.buckets + used);
+}
+
+void loadHistogram(skynet_multiportal::decaying_histogram & histogram, nlohmann::json const & buckets, double keep)
+{
+	for (size_t index = 0; index < buckets.size() && index < skynet_multiportal::decaying_histogram::bucket_count; ++ index) {
+		double weight = buckets[index].get<double>() * keep;
+		histogram.buckets[index] += weight;
+		histogram.weight += weight;
+	}
+}
+
+uint64_t hashUrl(std::string const & url)
+{
+	// fnv-1a, never 0 as that marks a free record
+	uint64_t hash = 0xcbf29ce484222325;
+	for (unsigned char c : url) {
+		hash = (hash ^ c) * 0x100000001b3;
+	}
+	return hash ? hash : 1;
+}
+
+int64_t systemNanoseconds()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void blendShared(std::atomic<uint64_t> & field, double sample, double weight)
+{
+	uint64_t bits = field;
+	uint64_t next;
+	do {
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		value += (sample - value) * weight;
+		std::memcpy(&next, &value, sizeof(next));
+	} while (!field.compare_exchange_weak(bits, next));
+}
+
+double bucketBound(size_t index)
+{
+	return 0.0001 * std::exp2(index / 4.0);
+}
+
+void skynet_multiportal::decaying_histogram::decay(double keep)
+{
+	for (auto & bucket : buckets) {
+		bucket *= keep;
+	}
+	weight *= keep;
+}
+
+void skynet_multiportal::decaying_histogram::add(std::chrono::steady_clock::duration sample)
+{
+	double seconds = std::chrono::duration<double>(sample).count();
+	size_t index = 0;
+	if (seconds > bucketBound(0)) {
+		index = std::min<size_t>(bucket_count - 1, std::ceil(4 * std::log2(seconds / bucketBound(0))));
+	}
+	buckets[index] += 1;
+	weight += 1;
+}
+
+std::chrono::steady_clock::duration skynet_multiportal::decaying_histogram::quantile(double fraction) const
+{
+	if (weight <= 0) { return std::chrono::steady_clock::duration::zero(); }
+	double target = fraction * weight;
+	double sum = 0;
+	size_t index = 0;
+	for (; index < bucket_count - 1; ++ index) {
+		sum += buckets[index];
+		if (sum >= target) { break; }
+	}
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(bucketBound(index)));
+}
+
+std::vector<metric_sample> sampleMetrics(std::vector<skynet_multiportal::portal_metrics *> const & portals)
+{
+	std::vector<metric_sample> result;
+	for (auto * portal : portals) {
+		std::string url;
+		{
+			std::lock_guard<std::mutex> lock(portal->mutex);
+			url = portal->portal.url;
+		}
+		for (size_t kind = 0; kind < skynet_multiportal::transfer_kind_count; ++ kind) {
+			auto & metric = portal->metrics[kind];
+			metric_sample sample{url, kindNames[kind], metric.speed, metric.first_byte, metric.reliability, metric.in_flight, portal->slots, portal->circuit, portal->consecutive_failures, metric.data, metric.successes, metric.errors, metric.cancellations, {}, {}};
+			std::lock_guard<std::mutex> lock(metric.mutex);
+			for (size_t index = 0; index < 3; ++ index) {
+				sample.time_to_first_byte[index] = std::chrono::duration<double>(metric.time_to_first_byte.quantile(quantiles[index])).count();
+				sample.latency[index] = std::chrono::duration<double>(metric.latency.quantile(quantiles[index])).count();
+			}
+			result.emplace_back(sample);
+		}
+	}
+	return result;
+}
+
+std::string skynet_multiportal::metrics_json()
+{
+	nlohmann::json result = nlohmann::json::object();
+	for (auto & sample : sampleMetrics(*std::atomic_load(&snapshot))) {
+		auto & entry = result[sample.url][sample.kind];
+		entry["speed"] = sample.speed;
+		entry["first_byte"] = sample.first_byte;
+		entry["reliability"] = sample.reliability;
+		entry["in_flight"] = sample.in_flight;
+		entry["slots"] = sample.slots;
+		static char const * const circuits[] = {"closed", "open", "half_open"};
+		entry["circuit"] = circuits[sample.circuit];
+		entry["consecutive_failures"] = sample.consecutive_failures;
+		entry["data"] = sample.data;
+		entry["successes"] = sample.successes;
+		entry["errors"] = sample.errors;
+		entry["cancellations"] = sample.cancellations;
+		for (size_t index = 0; index < 3; ++ index) {
+			std::string name = "p" + std::to_string(int(quantiles[index] * 100));
+			entry["time_to_first_byte"][name] = sample.time_to_first_byte[index];
+			entry["latency"][name] = sample.latency[index];
+		}
+	}
+	return result.dump();
+}
+
+std::string skynet_multiportal::metrics_prometheus()
+{
+	auto samples = sampleMetrics(*std::atomic_load(&snapshot));
+	std::ostringstream result;
+	auto labels = [](metric_sample const & sample) {
+		std::string url;
+		for (char c : sample.url) {
+			if (c == '\\' || c == '"') { url += '\\'; }
+			url += c;
+		}
+		return "portal=\"" + url + "\",kind=\"" + sample.kind + "\"";
+	};
+	auto gauge = [&](char const * name, char const * help, double metric_sample::*field) {
+		result << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n";
+		for (auto & sample : samples) {
+			result << name << "{" << labels(sample) << "} " << sample.*field << "\n";
+		}
+	};
+	gauge("siaskynet_portal_speed_bytes_per_second", "Decaying average body throughput after the first byte.", &metric_sample::speed);
+	gauge("siaskynet_portal_first_byte_seconds", "Decaying average time to first byte of successful transfers, or to connect for uploads.", &metric_sample::first_byte);
+	gauge("siaskynet_portal_reliability", "Decaying fraction of transfers that succeeded.", &metric_sample::reliability);
+
+	result << "# HELP siaskynet_portal_in_flight Transfers in progress.\n# TYPE siaskynet_portal_in_flight gauge\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_in_flight{" << labels(sample) << "} " << sample.in_flight << "\n";
+	}
+	result << "# HELP siaskynet_portal_slots Transfers allowed at once.\n# TYPE siaskynet_portal_slots gauge\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_slots{" << labels(sample) << "} " << sample.slots << "\n";
+	}
+	result << "# HELP siaskynet_portal_circuit Circuit state: 0 closed, 1 open, 2 half open.\n# TYPE siaskynet_portal_circuit gauge\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_circuit{" << labels(sample) << "} " << sample.circuit << "\n";
+	}
+	result << "# HELP siaskynet_portal_consecutive_failures Failures since the last success.\n# TYPE siaskynet_portal_consecutive_failures gauge\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_consecutive_failures{" << labels(sample) << "} " << sample.consecutive_failures << "\n";
+	}
+	result << "# HELP siaskynet_portal_bytes_total Bytes moved by successful transfers.\n# TYPE siaskynet_portal_bytes_total counter\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_bytes_total{" << labels(sample) << "} " << sample.data << "\n";
+	}
+	result << "# HELP siaskynet_portal_transfers_total Finished transfers by outcome.\n# TYPE siaskynet_portal_transfers_total counter\n";
+	for (auto & sample : samples) {
+		result << "siaskynet_portal_transfers_total{" << labels(sample) << ",outcome=\"success\"} " << sample.successes << "\n";
+		result << "siaskynet_portal_transfers_total{" << labels(sample) << ",outcome=\"error\"} " << sample.errors << "\n";
+		result << "siaskynet_portal_transfers_total{" << labels(sample) << ",outcome=\"cancelled\"} " << sample.cancellations << "\n";
+	}
+	auto quantile_gauge = [&](char const * name, char const * help, double (metric_sample::*field)[3]) {
+		result << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n";
+		for (auto & sample : samples) {
+			for (size_t index = 0; index < 3; ++ index) {
+				result << name << "{" << labels(sample) << ",quantile=\"" << quantiles[index] << "\"} " << (sample.*field)[index] << "\n";
+			}
+		}
+	};
+	quantile_gauge("siaskynet_portal_time_to_first_byte_seconds", "Decaying quantiles of time to first byte.", &metric_sample::time_to_first_byte);
+	quantile_gauge("siaskynet_portal_latency_seconds", "Decaying quantiles of time to complete successful transfers.", &metric_sample::latency);
+	return result.str();
 }
 
 } // namespace sia
@@ -1,5 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <future>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
@@ -11,11 +19,9 @@ public:
 	{
 		ERR_load_crypto_strings();
 		OpenSSL_add_all_algorithms();
-		mdctx = EVP_MD_CTX_create();
 	}
 	~crypto()
 	{
-		EVP_MD_CTX_destroy(mdctx);
 		EVP_cleanup();
 		CRYPTO_cleanup_all_ex_data();
 		ERR_free_strings();
@@ -26,6 +32,8 @@ public:
 		static thread_local std::vector<uint8_t> bytes;
 		bytes.resize(EVP_MAX_MD_SIZE);
 
+		// a context per digest, so that threads can hash at once
+		EVP_MD_CTX * mdctx = EVP_MD_CTX_create();
 		EVP_DigestInit_ex(mdctx, algorithm, NULL);
 
 		for (auto & chunk : data) {
@@ -34,6 +42,7 @@ public:
 
 		unsigned int size;
 		EVP_DigestFinal_ex(mdctx, bytes.data(), &size);
+		EVP_MD_CTX_destroy(mdctx);
 		bytes.resize(size);
 
 		result.resize(size * 2);
@@ -47,17 +56,119 @@ public:
 		}
 		return result;
 	}
-	nlohmann::json digests(std::initializer_list<std::vector<uint8_t> const *> data)
+	nlohmann::json digests(std::initializer_list<std::vector<uint8_t> const *> data, std::vector<std::string> const & names = algorithms())
 	{
-		return {
+		// large data is hashed by each algorithm on its own thread, once per call.
+		// streaming callers use a hasher, which stays on their thread.
+		size_t size = 0;
+		for (auto & chunk : data) {
+			size += chunk->size();
+		}
+		if (size >= parallel_size && names.size() > 1 && std::thread::hardware_concurrency() > 1) {
+			std::vector<std::future<std::map<std::string, std::string>>> parts;
+			for (auto & name : names) {
+				parts.emplace_back(std::async(std::launch::async, [&data, name]() {
+					hasher hashes({name});
+					for (auto & chunk : data) {
+						hashes.update(chunk->data(), chunk->size());
+					}
+					return hashes.finish();
+				}));
+			}
+			nlohmann::json result = nlohmann::json::object();
+			for (auto & part : parts) {
+				for (auto & digest : part.get()) {
+					result[digest.first] = digest.second;
+				}
+			}
+			return result;
+		}
+		hasher hashes(names);
+		for (auto & chunk : data) {
+			hashes.update(chunk->data(), chunk->size());
+		}
+		return hashes.finish();
+	}
+
+	static constexpr size_t parallel_size = 1024 * 1024;
+
+	// the digests computed when none are named
+	static std::vector<std::string> const & algorithms()
+	{
+		static std::vector<std::string> const names = {
 #ifndef OPENSSL_NO_BLAKE2
-			{"blake2b512", digest(data, EVP_blake2b512())},
+			"blake2b512",
 #endif
-			{"sha3_512", digest(data, EVP_sha3_512())},
-			{"sha512_256", digest(data, EVP_sha512_256())}
+			"sha3_512",
+			"sha512_256"
 		};
+		return names;
+	}
+
+	static decltype(EVP_sha3_512()) algorithm(std::string const & name)
+	{
+#ifndef OPENSSL_NO_BLAKE2
+		if (name == "blake2b512") { return EVP_blake2b512(); }
+#endif
+		if (name == "sha3_512") { return EVP_sha3_512(); }
+		if (name == "sha512_256") { return EVP_sha512_256(); }
+		throw std::runtime_error("Unknown digest " + name);
 	}
 
-private:
-	EVP_MD_CTX * mdctx;
+	// several digests of the same data in one pass.  input is fed to every algorithm
+	// a tile at a time, so each tile is hashed while it is in cache.
+	class hasher
+	{
+	public:
+		hasher(std::vector<std::string> const & names = algorithms())
+		{
+			for (auto & name : names) {
+				auto type = algorithm(name);
+				contexts.push_back({name, EVP_MD_CTX_create()});
+				EVP_DigestInit_ex(contexts.back().second, type, NULL);
+			}
+		}
+		hasher(hasher const &) = delete;
+		hasher & operator=(hasher const &) = delete;
+		~hasher()
+		{
+			for (auto & context : contexts) {
+				EVP_MD_CTX_destroy(context.second);
+			}
+		}
+
+		void update(uint8_t const * data, size_t size)
+		{
+			for (size_t offset = 0; offset < size; offset += tile_size) {
+				size_t tile = std::min(tile_size, size - offset);
+				for (auto & context : contexts) {
+					EVP_DigestUpdate(context.second, data + offset, tile);
+				}
+			}
+		}
+
+		// hex digests by name.  the hasher is spent afterwards.
+		std::map<std::string, std::string> finish()
+		{
+			static char const hex[] = "0123456789abcdef";
+			std::map<std::string, std::string> result;
+			unsigned char bytes[EVP_MAX_MD_SIZE];
+			for (auto & context : contexts) {
+				unsigned int size;
+				EVP_DigestFinal_ex(context.second, bytes, &size);
+				std::string & text = result[context.first];
+				text.resize(size * 2);
+				for (unsigned int i = 0; i < size; ++ i) {
+					text[i * 2] = hex[bytes[i] >> 4];
+					text[i * 2 + 1] = hex[bytes[i] & 0xf];
+				}
+			}
+			return result;
+		}
+
+		static constexpr size_t tile_size = 32 * 1024;
+
+	private:
+		std::vector<std::pair<std::string, EVP_MD_CTX *>> contexts;
+	};
 };
@@ -1,14 +1,25 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <future>
 // iostreams for debug
 #include <iostream>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <thread>
 
 #include <nlohmann/json.hpp>
 
 #include <siaskynet.hpp>
+#include <siaskynet_cache.hpp>
 
 #include "crypto.hpp"
+#include "skystream_metadata.hpp"
 
 using seconds_t = double;
 
@@ -23,118 +34,222 @@ public:
 	skystream()
 	{
 		auto now = time();
-		tail.metadata = {
-			{"content", {
-				{"spans",{
-					//{"real", {
-						{"time", {{"start", now}, {"end", now}}},
-						{"index", {{"start", 0}, {"end", 0}}},
-						{"bytes", {{"start", 0}, {"end", 0}}}
-					//}}
-				}}
-			}}//,
-			//{"flows", {}}
-		};
+		tail.metadata.spans[span_kind::time] = {now, now};
 	}
 	skystream(std::string way, std::string link)
 	{
 		std::vector<uint8_t> data;
-		tail.metadata = get_json({{way,link}});
-		tail.identifiers = cryptography.digests({&data});
+		tail.metadata = get_metadata({{way,link}}, &data);
+		tail.identifiers = cryptography.digests({&data}).get<skystream_identifiers>();
 		tail.identifiers[way] = link;
 	}
 	skystream(nlohmann::json identifiers)
-	: tail{identifiers, get_json(identifiers)}
+	: skystream(identifiers.get<skystream_identifiers>())
+	{ }
+	skystream(skystream_identifiers identifiers)
+	: tail{identifiers, get_metadata(identifiers), {}}
 	{ }
+	~skystream()
+	{
+		drop_read_ahead(true);
+		try {
+			pipeline(0);
+		} catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+		}
+	}
 
-	std::vector<uint8_t> read(std::string span, double offset, std::string flow = "real")
+	std::vector<uint8_t> read(std::string span_name, double offset, std::string flow = "real")
 	{
-		auto metadata = this->get_node(tail, span, offset).metadata;
-		auto metadata_content = metadata["content"];
-		double content_start = metadata_content["spans"][span]["start"];
-		if (span != "bytes" && offset != content_start) {
-			throw std::runtime_error(span + " " + std::to_string(offset) + " is within block span");
+		flush();
+		auto span = span_named(span_name);
+		auto called = std::chrono::steady_clock::now();
+		bool sequential = read_ahead_valid && span == read_ahead_span && offset == read_ahead_next;
+		if (sequential) {
+			average(consume_seconds, std::chrono::duration<double>(called - read_returned).count());
+		}
+
+		// take the next block from those read ahead, if it was fetched
+		fetched_block block;
+		bool found = false;
+		if (sequential && !prefetched.empty()) {
+			try {
+				if (prefetched.front().source.get().bounds[span].contains(offset)) {
+					block = prefetched.front().block.get();
+					found = true;
+				}
+			} catch (std::exception const &) {
+				// fetched again below, which reports any lasting error
+			}
+			if (prefetched.front().block.valid()) {
+				abandoned.emplace_back(std::move(prefetched.front().block));
+			}
+			prefetched.pop_front();
+		}
+		if (!found) {
+			drop_read_ahead();
+			block = fetch_block(span, offset);
 		}
-		auto data = get(metadata_content["identifiers"]);
+		average(fetch_seconds, block.seconds);
 
-		auto begin = data.begin() + offset - content_start;
-		auto end = data.begin() + metadata_content["bounds"]["bytes"]["end"] - content_start;
+		auto & content_spans = block.source.metadata.spans;
+		if (span != span_kind::bytes && offset != content_spans[span].start) {
+			throw std::runtime_error(span_name + " " + std::to_string(offset) + " is within block span");
+		}
+		auto & data = block.data;
+
+		// the data is indexed by bytes whichever span is read
+		double bytes_start = content_spans[span_kind::bytes].start;
+		auto begin = data.begin() + (span == span_kind::bytes ? offset - bytes_start : 0);
+		auto end = data.begin() + (block.source.bounds[span_kind::bytes].end - bytes_start);
 		(void)flow;
-		return {begin, end};
+		std::vector<uint8_t> result{begin, end};
+
+		read_ahead_valid = true;
+		read_ahead_span = span;
+		read_ahead_next = block.source.bounds[span].end;
+		if (sequential && read_ahead_bytes) {
+			queue_read_ahead(span, block.source, result.size());
+		}
+		read_returned = std::chrono::steady_clock::now();
+		return result;
+	}
+
+	// sequential reads fetch the blocks after them ahead, in parallel.  enough are
+	// fetched to cover the time a fetch takes at the rate blocks are read, up to
+	// max_bytes of blocks the size of the last.  0 turns reading ahead off.
+	void read_ahead(size_t max_bytes)
+	{
+		read_ahead_bytes = max_bytes;
+		if (!max_bytes) { drop_read_ahead(); }
 	}
 
-	void write(std::vector<uint8_t> & data, std::string span, double offset)
+	// the digests that identify blocks written, computed together in one pass.
+	// blocks read are checked against those of them they carry, or against all
+	// they carry if none.  defaults to crypto::algorithms().
+	void digests(std::vector<std::string> names)
 	{
+		if (names.empty()) { throw std::runtime_error("No digests named"); }
+		for (auto & name : names) {
+			crypto::algorithm(name);
+		}
+		flush();
+		drop_read_ahead(true);
+		digest_names = std::move(names);
+	}
+
+	void write(std::vector<uint8_t> & data, std::string span_name, double offset)
+	{
+		auto span = span_named(span_name);
+
+		// blocks read ahead may be replaced, and fetching them reads the tail
+		drop_read_ahead(true);
+		read_ahead_valid = false;
+
 		seconds_t end_time = time();
-		seconds_t start_time = tail.metadata["content"]["spans"]["time"]["end"];
-		
+		if (!pipeline_depth) {
+			write_block(data, span, offset, end_time, {});
+			return;
+		}
+
+		// the content is hashed and uploaded on its own thread, and its metadata
+		// written in order behind the blocks before it
+		auto block = std::make_shared<std::vector<uint8_t> const>(data);
+		std::unique_lock<std::mutex> lock(pipeline_mutex);
+		pipeline_changed.wait(lock, [&]{ return pipeline_queue.size() < pipeline_depth || pipeline_error; });
+		if (pipeline_error) {
+			// the blocks queued behind the failure finish before it is reported
+			pipeline_changed.wait(lock, [&]{ return pipeline_queue.empty(); });
+			std::rethrow_exception(std::exchange(pipeline_error, nullptr));
+		}
+		pipeline_queue.push_back({block, span, offset, end_time, std::async(std::launch::async, [this, block]() {
+			return upload_content(*block);
+		})});
+		pipeline_changed.notify_all();
+	}
+
+	// pipelined writes: up to depth blocks upload their content at once while
+	// their metadata is written behind them in order, so write returns as soon as
+	// there is room.  0, the default, writes each block before write returns.
+	void pipeline(size_t depth)
+	{
+		std::exception_ptr error;
+		{
+			std::unique_lock<std::mutex> lock(pipeline_mutex);
+			pipeline_changed.wait(lock, [&]{ return pipeline_queue.empty(); });
+			error = std::exchange(pipeline_error, nullptr);
+			pipeline_depth = depth;
+			pipeline_stopping = !depth;
+			pipeline_changed.notify_all();
+		}
+		if (!depth && pipeline_thread.joinable()) {
+			pipeline_thread.join();
+		} else if (depth && !pipeline_thread.joinable()) {
+			pipeline_thread = std::thread(&skystream::pipeline_worker, this);
+		}
+		// a failed write is reported once the worker is stopped, so the
+		// destructor never leaves it running
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// wait for pipelined writes to finish, throwing the first error among them
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(pipeline_mutex);
+		pipeline_changed.wait(lock, [&]{ return pipeline_queue.empty(); });
+		if (pipeline_error) {
+			std::rethrow_exception(std::exchange(pipeline_error, nullptr));
+		}
+	}
+
+private:
+	// content_identifiers are those of content already uploaded on its own, or
+	// empty to upload the content beside the metadata
+	void write_block(std::vector<uint8_t> const & data, span_kind span, double offset, seconds_t end_time, skystream_identifiers content_identifiers)
+	{
+		seconds_t start_time = tail.metadata.spans[span_kind::time].end;
+
 		node head_node;
-		nlohmann::json head_bounds;
+		skystream_spans head_bounds;
+		bool head_split = false;
 		unsigned long long start_bytes;
 		//unsigned long long full_size = data.size(); // let's try to implement by reusing surrounding data
-		unsigned long long index = tail.metadata["content"]["spans"]["index"]["end"];
-		if (offset == tail.metadata["content"]["spans"][span]["end"]) {
+		unsigned long long index = tail.metadata.spans[span_kind::index].end;
+		if (offset == tail.metadata.spans[span].end) {
 			// append case, no head node to replace
-			start_bytes = tail.metadata["content"]["spans"]["bytes"]["end"];
+			start_bytes = tail.metadata.spans[span_kind::bytes].end;
 			//full_size = data.size();
 		} else {
-			nlohmann::json head_node_bounds;
-			head_node = this->get_node(this->tail, span, offset);
-			auto head_node_content = head_node.metadata["content"];
-			double start_head = head_node_content["bounds"][span]["start"];
-			start_bytes = head_node_content["bounds"]["bytes"]["start"]; 
+			head_node = find_node(span, offset);
+			double start_head = head_node.bounds[span].start;
+			start_bytes = head_node.bounds[span_kind::bytes].start;
 			if (offset != start_head) {
-				if (span != "bytes") {
-					throw std::runtime_error(span + " " + std::to_string(offset) + " is within block span");
+				if (span != span_kind::bytes) {
+					throw std::runtime_error(std::string(span_name(span)) + " " + std::to_string(offset) + " is within block span");
 				} else {
 					start_bytes = offset;
-					for (auto bound : head_node_content["bounds"].items()) {
-						if (bound.key() == "bytes") {
-							head_bounds["bytes"] = {{"start", bound.value()["start"]},{"end", start_bytes}};
-						} else {
-							head_bounds[bound.key()] = {{"start", bound.value()["start"]},{"end", bound.value()["end"]}};
-						}
-					}
+					head_bounds = head_node.bounds;
+					head_bounds[span_kind::bytes].end = start_bytes;
+					head_split = true;
 				}
 			}
 			//full_size = data.size() + offset - start_head; // full_size is the number of bytes including the beginning bits of head_node
 		}
 		unsigned long long end_bytes = start_bytes + data.size(); /*full_size*/
-		nlohmann::json spans = { // these are the spans of the new write
-			{"time", {{"start", start_time},{"end", end_time}}},
-			{"bytes", {{"start", start_bytes},{"end", end_bytes}}},
-			{"index", {{"start", index}, {"end", index + 1}}}
-		};
-		node * tail_node;
-		nlohmann::json tail_bounds;
-		try {
-			tail_node = &get_node(tail, "bytes", end_bytes);
-			auto tail_node_content = tail_node->metadata["content"];
-			if (end_bytes != tail_node_content["bounds"]["bytes"]["start"]) {
-				for (auto bound : tail_node_content["bounds"].items()) {
-						if (bound.key() == "bytes") {
-							tail_bounds["bytes"] = {{"start", end_bytes},{"end", bound.value()["end"]}};
-						} else {
-							tail_bounds[bound.key()] = {{"start", bound.value()["start"]},{"end", bound.value()["end"]}};
-						}
-				}
-			}
-		} catch (std::out_of_range const &) {
-			tail_node = &tail;
-		}
+		skystream_spans spans; // these are the spans of the new write
+		spans[span_kind::time] = {start_time, end_time};
+		spans[span_kind::bytes] = {double(start_bytes), double(end_bytes)};
+		spans[span_kind::index] = {double(index), double(index + 1)};
 
-		nlohmann::json lookup_nodes = nlohmann::json::array();
+		std::vector<skystream_lookup> lookup_nodes;
 		//size_t depth = 0;
-		nlohmann::json new_lookup_node;
 		node preceding;
-		lookup_nodes.clear();
 		if (start_bytes > 0) { try {
-			preceding = this->get_node(tail, "bytes", start_bytes - 1); // preceding 
-			new_lookup_node = preceding.metadata["content"];
-			new_lookup_node["identifiers"] = preceding.identifiers;
-			new_lookup_node["depth"] = 0;
-			lookup_nodes = preceding.metadata["lookup"]; // everything in lookup nodes is accessible via preceding's identifiers
-			lookup_nodes.emplace_back(new_lookup_node);
+			preceding = find_node(span_kind::bytes, start_bytes - 1); // preceding
+			lookup_nodes = preceding.metadata.lookup; // everything in lookup nodes is accessible via preceding's identifiers
+			lookup_nodes.push_back({preceding.identifiers, preceding.metadata.spans, 0});
 		} catch (std::out_of_range const &) { } }
 
 		// 8: we have a new way of merging lookup nodes.  we merge all adjacent pairs with equal depth, repeatedly.
@@ -142,11 +257,10 @@ public:
 		for (size_t index = 0; index + 1 < lookup_nodes.size();) {
 			auto & current_node = lookup_nodes[index];
 			auto & next_node = lookup_nodes[index + 1];
-			if (current_node["depth"] == next_node["depth"]) {
-				auto next_spans = next_node["spans"];
-				for (auto & span : current_node["spans"].items()) {
-					auto & current_span = span.value();
-					auto & next_span = next_spans[span.key()];
+			if (current_node.depth == next_node.depth) {
+				for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+					auto & current_span = current_node.spans.spans[kind];
+					auto & next_span = next_node.spans.spans[kind];
 					// 10: we're changing the format to use "flows" of "real" and "logic" as below
 					// 		[this change is at the edge of checks for likely-to-finish-task.  this is known.
 					// 		 so, no more generalization until something is working and usable.]
@@ -191,14 +305,12 @@ public:
 
 					// NOTE: we need to update identifiers of lookup_nodes to point to something that contains both
 
-					auto & current_end = current_span["end"];
-					auto & next_end = next_span["end"];
-					assert (current_end == next_span["start"]);
-					if (current_end < next_end) { current_end = next_end; }
+					assert (current_span.end == next_span.start);
+					if (current_span.end < next_span.end) { current_span.end = next_span.end; }
 				}
-				current_node["identifiers"] = preceding.identifiers;
-				current_node["depth"] = (unsigned long long)current_node["depth"] + 1;
-				lookup_nodes.erase(index + 1);
+				current_node.identifiers = preceding.identifiers;
+				++ current_node.depth;
+				lookup_nodes.erase(lookup_nodes.begin() + index + 1);
 			} else {
 				++ index;
 			}
@@ -223,13 +335,13 @@ public:
 
 		// end: we can make a new tail metadata node that indexes everything afterward.  it can even have tree nodes if desired.
 		// 5: remaining before testing: build lookup nodes using three more sources in 1-2-3 order
-		//  1. if !head_bounds.is_null(), then add a lookup reference for head
+		//  1. if the head is split, then add a lookup reference for head
 			// note: we can't merge this lookup node with previous because it is the only one with a link to its content.
-		if (!head_bounds.is_null()) {
-			lookup_nodes.emplace_back(nlohmann::json{
-				{"identifiers", head_node.identifiers},
-				{"spans", head_bounds},
-				{"depth", 0} // now .... will this get merged if we append to tail after this?
+		if (head_split) {
+			lookup_nodes.push_back({
+				head_node.identifiers,
+				head_bounds,
+				0 // now .... will this get merged if we append to tail after this?
 						// when appending we assuming depth reduces forward, which is no longer true.
 						// we probably want to reduce depth within as well as forward.
 			});
@@ -238,36 +350,37 @@ public:
 		//  2. if !tail_bounds.is_null(), then add a lookup reference for tail
 		//  3. reference node hierarchies until real tail to complete reference to rest of doc
 
-		auto content_identifiers = cryptography.digests({&data});
-		nlohmann::json metadata_json = {
-			{"sia-skynet-stream", "1.0.10"},
-			{"content", {
-				{"spans", spans},
-				{"identifiers", content_identifiers},
-			}},
-			/* 10:
-			{"flow", { 
-				{"logical", lookup_nodes},
-				{"creation", append_only_lookup_nodes_of_time_and_index}
-			}},
-			*/
-			{"lookup", lookup_nodes}
-		};
-		std::string metadata_string = metadata_json.dump();
-		std::cerr << metadata_string << std::endl;
+		bool content_uploaded = !content_identifiers.empty();
+		if (!content_uploaded) {
+			content_identifiers = cryptography.digests({&data}, digest_names).get<skystream_identifiers>();
+		}
+		skystream_metadata metadata{spans, content_identifiers, lookup_nodes};
+		/* 10:
+		{"flow", {
+			{"logical", lookup_nodes},
+			{"creation", append_only_lookup_nodes_of_time_and_index}
+		}},
+		*/
+		std::cerr << metadata.json().dump() << std::endl;
 
-		sia::skynet::upload_data metadata_upload("metadata.json", std::vector<uint8_t>{metadata_string.begin(), metadata_string.end()}, "application/json");
-		sia::skynet::upload_data content("content", data, "application/octet-stream");
+		sia::skynet::upload_data metadata_upload("metadata.cbor", metadata.encode(), "application/cbor");
+		auto content = sia::skynet::upload_data::borrowed("content", data.data(), data.size(), "application/octet-stream");
 
 		// CHANGE 3C: let's try to reuse all surrounding data using the new 'bounds' attribute
 		// 3C: TODO: we want to insert into content from head_node if we are doing a midway-write (full_size above).  we could also split the write into two.
 
-		auto metadata_identifiers = cryptography.digests({&metadata_upload.data});
+		auto metadata_identifiers = cryptography.digests({&metadata_upload.data}, digest_names).get<skystream_identifiers>();
 
+		// the directory is named by the first digest
+		std::string const & directory = metadata_identifiers.at(digest_names.front());
 		std::string skylink;
 		while (true) {
 			try {
-				skylink = portal.upload(metadata_identifiers["sha3_512"], {metadata_upload, content});
+				if (content_uploaded) {
+					skylink = portal.upload(directory, {metadata_upload});
+				} else {
+					skylink = portal.upload(directory, {metadata_upload, content});
+				}
 				break;
 			} catch(std::runtime_error const & e) {
 				std::cerr << e.what() << std::endl;
@@ -275,20 +388,45 @@ public:
 			}
 		}
 		metadata_identifiers["skylink"] = skylink + "/" + metadata_upload.filename;
+		if (!content_uploaded) {
+			// as get_metadata finds it, so the tail can be read back
+			metadata.identifiers["skylink"] = skylink + "/" + content.filename;
+		}
 
 		// if we want to supporto threading we'll likely need a lock around this whole function (not just the change to tail)
+		std::lock_guard<std::mutex> lock(nodes_mutex);
+		if (tail.identifiers.size()) {
+			cache_node(node_key(tail.identifiers), std::make_shared<node const>(tail), false);
+		}
+		// the nodes nearest the tail change with it
+		for (auto & key : cache_pinned) {
+			auto pinned = cache.find(key);
+			if (pinned == cache.end()) { continue; }
+			pinned->second.pinned = false;
+			cache_recent.push_front(key);
+			pinned->second.recent = cache_recent.begin();
+		}
+		cache_pinned.clear();
+		evict_nodes();
 		tail.identifiers = metadata_identifiers;
-		tail.metadata = metadata_json;
+		tail.metadata = metadata;
+		// blocks past the start of this one are replaced or no longer reachable
+		if (indexed_bytes_end > start_bytes) {
+			for (auto & index : span_index) {
+				index.clear();
+			}
+			indexed_bytes_end = 0;
+		}
 	}
 
+public:
 	std::map<std::string,std::pair<double,double>> block_spans(std::string span, double offset)
 	{
-		auto metadata = this->get_node(tail, span, offset).metadata;
+		flush();
+		auto bounds = find_node(span_named(span), offset).bounds;
 		std::map<std::string,std::pair<double,double>> result;
-		for (auto & content_span : metadata["content"]["bounds"].items()) {
-			auto span = content_span.key();
-			result[span].second = content_span.value()["end"];
-			result[span].first = content_span.value()["start"];
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			result[span_name(span_kind(kind))] = {bounds.spans[kind].start, bounds.spans[kind].end};
 		}
 		return result;
 	}
@@ -300,18 +438,18 @@ public:
 
 	std::map<std::string,std::pair<double,double>> spans()
 	{
+		flush();
 		std::map<std::string,std::pair<double,double>> result;
-		for (auto & content_span : tail.metadata["content"]["spans"].items()) {
-			auto span = content_span.key();
-			result[span].second = content_span.value()["end"];
-			result[span].first = content_span.value()["start"];
-		}
-		for (auto & lookup : tail.metadata["lookup"]) {
-			for (auto & lookup_span : lookup["spans"].items()) {
-				auto span = lookup_span.key();
-				double point = lookup_span.value()["start"];
-				if (point < result[span].first) {
-					result[span].first = point;
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			auto & content_span = tail.metadata.spans.spans[kind];
+			result[span_name(span_kind(kind))] = {content_span.start, content_span.end};
+		}
+		for (auto & lookup : tail.metadata.lookup) {
+			for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+				auto & first = result[span_name(span_kind(kind))].first;
+				double point = lookup.spans.spans[kind].start;
+				if (point < first) {
+					first = point;
 				}
 			}
 		}
@@ -339,88 +477,393 @@ public:
 
 	nlohmann::json identifiers()
 	{
+		flush();
 		return tail.identifiers;
 	}
 
+	// metadata nodes are cached up to about max_bytes, the least recently used
+	// going first.  the nodes nearest the tail are kept regardless, as every
+	// lookup passes through them.
+	void node_cache(size_t max_bytes)
+	{
+		std::lock_guard<std::mutex> lock(nodes_mutex);
+		cache_max_bytes = max_bytes;
+		evict_nodes();
+	}
+
+	struct node_cache_counters
+	{
+		unsigned long long hits = 0;
+		unsigned long long misses = 0;
+		unsigned long long evictions = 0;
+		size_t bytes = 0;
+		size_t nodes = 0;
+		size_t pinned = 0;
+	};
+	node_cache_counters node_cache_stats()
+	{
+		std::lock_guard<std::mutex> lock(nodes_mutex);
+		auto result = cache_counters;
+		result.bytes = cache_total;
+		result.nodes = cache.size();
+		result.pinned = cache_pinned.size();
+		return result;
+	}
+
 private:
 	struct node
 	{
-		nlohmann::json identifiers;
-		nlohmann::json metadata;
+		skystream_identifiers identifiers;
+		skystream_metadata metadata;
+		skystream_spans bounds; // of the content, narrowed by the lookups that led to it
 	};
 
-	node & get_node(node & start, std::string span, double offset, nlohmann::json bounds = {})
-	{
-		auto content_spans = start.metadata["content"]["spans"];
-		auto content_span = content_spans[span];
-		if (offset >= content_span["start"] && offset < content_span["end"]) {
-			start.metadata["content"]["bounds"] = bounds.is_null() ? content_spans : bounds;
-			return start;
-		}
-		for (auto & lookup : start.metadata["lookup"]) {
-			auto lookup_spans = lookup["spans"];
-			for (auto & bound : bounds.items()) {
-				if (!lookup_spans.contains(bound.key())) { continue; }
-				auto bound_span = lookup_spans[bound.key()];
-				if (bound.value()["begin"] > bound_span["begin"]) {
-					bound_span["begin"] = bound.value()["begin"];
-				}
-				if (bound.value()["end"] < bound_span["end"]) {
-					bound_span["end"] = bound.value()["end"];
+	struct cached_entry
+	{
+		std::shared_ptr<node const> value;
+		size_t bytes;
+		bool pinned;
+		std::list<std::string>::iterator recent;
+	};
+
+	// nodes are looked up under nodes_mutex, which is let go while fetching one.
+	// the node holding offset is copied, so it can be read while other threads look.
+	// spans found through a lookup are narrowed to the spans of the lookup.
+	// content is passed on to cached_node for the lookups of single blocks, which
+	// hold offset in their content
+	node get_node(node const & start, span_kind span, double offset, skystream_spans const * bounds = nullptr, unsigned level = 0, std::optional<std::vector<uint8_t>> * content = nullptr)
+	{
+		std::unique_lock<std::mutex> lock(nodes_mutex);
+		if (start.metadata.spans[span].contains(offset)) {
+			node result = start;
+			result.bounds = bounds ? intersect(start.metadata.spans, *bounds) : start.metadata.spans;
+			return result;
+		}
+		for (auto & lookup : start.metadata.lookup) {
+			auto lookup_spans = bounds ? intersect(lookup.spans, *bounds) : lookup.spans;
+			if (lookup_spans[span].contains(offset)) {
+				auto next = cached_node(lookup.identifiers, lock, level < pinned_levels, lookup.depth ? nullptr : content);
+				if (content && !next->metadata.spans[span].contains(offset)) {
+					content->reset();
 				}
+				lock.unlock();
+				return get_node(*next, span, offset, &lookup_spans, level + 1, content);
 			}
-			auto lookup_span = lookup["spans"][span];
-			double start = lookup_span["start"];
-			double end = lookup_span["end"];
-			if (offset >= start && offset < end) {
-				auto identifiers = lookup["identifiers"];
-				std::string identifier = identifiers.begin().value();
-				if (!cache.count(identifier)) {
-					cache[identifier] = node{identifiers, get_json(identifiers)};
-				}
-				return get_node(cache[identifier], span, offset, lookup_spans);
+		}
+		throw std::out_of_range(std::string(span_name(span)) + " " + std::to_string(offset) + " out of range");
+	}
+
+	// the cached node with these identifiers, fetched if need be.  called with
+	// nodes_mutex held, and returns with it held.  pinned nodes are not evicted.
+	// if the node is fetched, content is set as by get_metadata.
+	std::shared_ptr<node const> cached_node(skystream_identifiers const & identifiers, std::unique_lock<std::mutex> & lock, bool pin = false, std::optional<std::vector<uint8_t>> * content = nullptr)
+	{
+		std::string key = node_key(identifiers);
+		if (tail.identifiers.size() && key == node_key(tail.identifiers)) {
+			// the tail outlives lookups, so it is not owned
+			return {std::shared_ptr<node const>(), &tail};
+		}
+		auto cached = cache.find(key);
+		if (cached != cache.end()) {
+			++ cache_counters.hits;
+			return use_node(cached->second, key, pin);
+		}
+		++ cache_counters.misses;
+		auto fetching = identifiers;
+		lock.unlock();
+		auto fetched = std::make_shared<node const>(node{fetching, get_metadata(fetching, nullptr, content), {}});
+		lock.lock();
+		return cache_node(key, fetched, pin);
+	}
+
+	// adds a node unless another thread did first, and returns the one kept
+	std::shared_ptr<node const> cache_node(std::string const & key, std::shared_ptr<node const> value, bool pin)
+	{
+		auto cached = cache.find(key);
+		if (cached != cache.end()) {
+			return use_node(cached->second, key, pin);
+		}
+		auto & entry = cache[key];
+		entry.value = value;
+		entry.bytes = node_bytes(*value);
+		entry.pinned = pin;
+		if (pin) {
+			cache_pinned.push_back(key);
+		} else {
+			cache_recent.push_front(key);
+			entry.recent = cache_recent.begin();
+		}
+		cache_total += entry.bytes;
+		evict_nodes();
+		return value;
+	}
+
+	std::shared_ptr<node const> use_node(cached_entry & entry, std::string const & key, bool pin)
+	{
+		if (entry.pinned) {
+			return entry.value;
+		}
+		if (pin) {
+			cache_recent.erase(entry.recent);
+			cache_pinned.push_back(key);
+			entry.pinned = true;
+		} else {
+			cache_recent.splice(cache_recent.begin(), cache_recent, entry.recent);
+		}
+		return entry.value;
+	}
+
+	void evict_nodes()
+	{
+		while (cache_total > cache_max_bytes && !cache_recent.empty()) {
+			auto evicted = cache.find(cache_recent.back());
+			cache_total -= evicted->second.bytes;
+			cache.erase(evicted);
+			cache_recent.pop_back();
+			++ cache_counters.evictions;
+		}
+	}
+
+	// roughly the memory a node takes
+	static size_t node_bytes(node const & value)
+	{
+		auto identifier_bytes = [](skystream_identifiers const & identifiers) {
+			size_t bytes = 0;
+			for (auto & identifier : identifiers) {
+				bytes += 64 + identifier.first.size() + identifier.second.size();
 			}
+			return bytes;
+		};
+		size_t bytes = sizeof(node) + identifier_bytes(value.identifiers) + identifier_bytes(value.metadata.identifiers);
+		for (auto & lookup : value.metadata.lookup) {
+			bytes += sizeof(lookup) + identifier_bytes(lookup.identifiers);
+		}
+		return bytes;
+	}
+
+	static std::string const & node_key(skystream_identifiers const & identifiers)
+	{
+		return identifiers.begin()->second;
+	}
+
+	static skystream_spans intersect(skystream_spans spans, skystream_spans const & bounds)
+	{
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			auto & span = spans.spans[kind];
+			span.start = std::max(span.start, bounds.spans[kind].start);
+			span.end = std::min(span.end, bounds.spans[kind].end);
 		}
-		throw std::out_of_range(span + " " + std::to_string(offset) + " out of range");
+		return spans;
 	}
 
-	nlohmann::json get_json(nlohmann::json identifiers, std::vector<uint8_t> * data = nullptr)
+	// the node holding offset as seen from the tail.  blocks found before are
+	// looked up in span_index, and others are found from the tail and added to it.
+	// if content is given, it is set if the block's content came with its metadata.
+	node find_node(span_kind span, double offset, std::optional<std::vector<uint8_t>> * content = nullptr)
 	{
-		auto data_result = get(identifiers);
-		if (data) { *data = data_result; }
-		auto result = nlohmann::json::parse(data_result);
-		// TODO improve (refactor?), hardcodes storage system and is slow due to 2 requests for each chunk
-		std::string skylink = identifiers["skylink"];
-		skylink.resize(52); skylink += "/content";
-		result["content"]["identifiers"]["skylink"] = skylink;
+		std::unique_lock<std::mutex> lock(nodes_mutex);
+		auto & index = span_index[size_t(span)];
+		// the tail's own content comes before any block it looks up
+		bool in_tail = tail.metadata.spans[span].contains(offset);
+		auto found = index.upper_bound(offset);
+		if (!in_tail && found != index.begin() && (-- found)->second->bounds[span].contains(offset)) {
+			auto block = found->second;
+			node result = *cached_node(block->identifiers, lock, false, content);
+			result.bounds = block->bounds;
+			return result;
+		}
+		lock.unlock();
+
+		node result = get_node(tail, span, offset, nullptr, 0, content);
+		auto block = std::make_shared<indexed_block const>(indexed_block{result.identifiers, result.bounds});
+		lock.lock();
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			auto & bound = block->bounds.spans[kind];
+			if (bound.start < bound.end) {
+				span_index[kind][bound.start] = block;
+			}
+		}
+		indexed_bytes_end = std::max(indexed_bytes_end, block->bounds[span_kind::bytes].end);
 		return result;
 	}
 
-	std::vector<uint8_t> get(nlohmann::json identifiers)
+	// a download that fails, or whose data does not verify, is tried again on the
+	// next known portal, up to max_attempts times in all.  a cached copy of it
+	// is dropped first, so that the retry fetches it afresh.
+	template <typename Attempt>
+	auto attempts(std::string const & skylink, Attempt attempt) -> decltype(attempt(std::declval<sia::skynet &>()))
 	{
-		auto skylink = identifiers["skylink"];
-		std::vector<uint8_t> result;
-		while (true) {
+		auto portals = sia::skynet::portals();
+		size_t first = 0;
+		while (first < portals.size() && portals[first].url != portal.options.url) {
+			++ first;
+		}
+		for (unsigned count = 1;; ++ count) {
 			try {
-				result = portal.download(skylink).data;
-				break;
-			} catch(std::runtime_error const & e) {
+				if (count == 1 || portals.empty()) {
+					return attempt(portal);
+				}
+				sia::skynet other(portals[(first + count - 1) % portals.size()]);
+				other.cache = portal.cache;
+				return attempt(other);
+			} catch (std::runtime_error const & e) {
+				if (portal.cache) {
+					portal.cache->erase(sia::skynet_cache::key(skylink));
+				}
+				if (count >= max_attempts) { throw; }
 				std::cerr << e.what() << std::endl;
-				continue;
 			}
 		}
-		auto digests = cryptography.digests({&result});
-		for (auto & digest : digests.items()) {
-			if (identifiers.contains(digest.key())) {
-				if (digest.value() != identifiers[digest.key()]) {
-					throw std::runtime_error(digest.key() + " digest mismatch.  identifiers=" + identifiers.dump() + " digests=" + digests.dump());
+	}
+
+	// if content is given and the block's content was uploaded beside its metadata,
+	// the directory holding both is fetched in one request and content is set
+	skystream_metadata get_metadata(skystream_identifiers const & identifiers, std::vector<uint8_t> * data = nullptr, std::optional<std::vector<uint8_t>> * content = nullptr)
+	{
+		std::string const & skylink = identifiers.at("skylink");
+		std::vector<uint8_t> data_result;
+		std::optional<std::vector<uint8_t>> content_result;
+		std::map<std::string, std::string> content_digests;
+		if (content && skylink.size() > 53 && skylink[52] == '/') {
+			std::string directory = skylink.substr(0, 52);
+			std::string filename = skylink.substr(53);
+			auto names = verified_digests(identifiers);
+			bool split = attempts(directory, [&](sia::skynet & source) {
+				// each subfile is hashed as it passes, where the portal reports it to be
+				struct part {
+					size_t offset;
+					size_t len;
+					std::vector<uint8_t> * data;
+					crypto::hasher * hashes;
+				};
+				crypto::hasher metadata_hashes(names);
+				crypto::hasher content_hashes(digest_names);
+				std::vector<part> parts;
+				bool found = false;
+				data_result.clear();
+				content_result.reset();
+				sia::skynet::start_callback start = [&](sia::skynet::response const & headers) {
+					for (auto & subfile : headers.metadata.subfiles) {
+						if (subfile.first == filename) {
+							data_result.reserve(subfile.second.len);
+							parts.push_back({subfile.second.offset, subfile.second.len, &data_result, &metadata_hashes});
+							found = true;
+						} else if (subfile.first == "content") {
+							content_result.emplace();
+							content_result->reserve(subfile.second.len);
+							parts.push_back({subfile.second.offset, subfile.second.len, &*content_result, &content_hashes});
+						}
+					}
+				};
+				size_t position = 0;
+				sia::skynet::sink output = [&](uint8_t const * data, size_t size) {
+					for (auto & part : parts) {
+						size_t from = std::max(position, part.offset);
+						size_t to = std::min(position + size, part.offset + part.len);
+						if (from >= to) { continue; }
+						part.data->insert(part.data->end(), data + (from - position), data + (to - position));
+						part.hashes->update(data + (from - position), to - from);
+					}
+					position += size;
+				};
+				source.download(directory, {}, output, start);
+				try {
+					if (!found) { return false; }
+					check(identifiers, metadata_hashes.finish());
+				} catch (std::runtime_error const &) {
+					content_result.reset();
+					return false;
 				}
+				content_digests = content_hashes.finish();
+				return true;
+			});
+			if (!split) {
+				if (portal.cache) {
+					portal.cache->erase(sia::skynet_cache::key(directory));
+				}
+				data_result = get(identifiers);
+			}
+		} else {
+			data_result = get(identifiers);
+		}
+		auto result = skystream_metadata::decode(data_result);
+		if (data) { *data = std::move(data_result); }
+		// TODO improve (refactor?), hardcodes storage system
+		// content uploaded beside its metadata has no skylink of its own
+		if (!result.identifiers.count("skylink")) {
+			std::string content_skylink = skylink;
+			content_skylink.resize(52); content_skylink += "/content";
+			result.identifiers["skylink"] = content_skylink;
+			if (content_result) {
+				try {
+					// content is rehashed only if it carries none of the digests hashed as it arrived
+					std::map<std::string, std::string> digests;
+					for (auto & name : verified_digests(result.identifiers)) {
+						if (content_digests.count(name)) { digests[name] = content_digests[name]; }
+					}
+					if (digests.empty()) {
+						verify(result.identifiers, *content_result);
+					} else {
+						check(result.identifiers, digests);
+					}
+					*content = std::move(content_result);
+				} catch (std::runtime_error const &) { }
 			}
 		}
 		return result;
 	}
 
-	nlohmann::json lookup_nodes(node & source, nlohmann::json & bounds)
+	// blocks are hashed as they arrive, so they are verified with the last byte
+	std::vector<uint8_t> get(skystream_identifiers const & identifiers, size_t size_hint = 0)
+	{
+		std::string const & skylink = identifiers.at("skylink");
+		auto names = verified_digests(identifiers);
+		return attempts(skylink, [&](sia::skynet & source) {
+			std::vector<uint8_t> result;
+			result.reserve(size_hint);
+			crypto::hasher hashes(names);
+			sia::skynet::sink output = [&](uint8_t const * data, size_t size) {
+				hashes.update(data, size);
+				result.insert(result.end(), data, data + size);
+			};
+			source.download(skylink, {}, output);
+			check(identifiers, hashes.finish());
+			return result;
+		});
+	}
+
+	// those of the chosen digests the identifiers carry, or any they carry if none
+	std::vector<std::string> verified_digests(skystream_identifiers const & identifiers)
+	{
+		std::vector<std::string> names;
+		for (auto & name : digest_names) {
+			if (identifiers.count(name)) { names.push_back(name); }
+		}
+		if (names.empty()) {
+			for (auto & name : crypto::algorithms()) {
+				if (identifiers.count(name)) { names.push_back(name); }
+			}
+		}
+		return names;
+	}
+
+	void verify(skystream_identifiers const & identifiers, std::vector<uint8_t> const & data)
+	{
+		crypto::hasher hashes(verified_digests(identifiers));
+		hashes.update(data.data(), data.size());
+		check(identifiers, hashes.finish());
+	}
+
+	void check(skystream_identifiers const & identifiers, std::map<std::string, std::string> const & digests)
+	{
+		for (auto & digest : digests) {
+			if (digest.second != identifiers.at(digest.first)) {
+				throw std::runtime_error(digest.first + " digest mismatch.  identifiers=" + nlohmann::json(identifiers).dump() + " digests=" + nlohmann::json(digests).dump());
+			}
+		}
+	}
+
+	std::vector<skystream_lookup> lookup_nodes(node & source, skystream_spans & bounds)
 	{
 		// to do this right, consider that source's content may be in the middle of its lookups.  so you want to put it in the right spot.
 		(void)source;
@@ -428,10 +871,183 @@ private:
 		return {}; // STUB
 	}
 
+	skystream_identifiers upload_content(std::vector<uint8_t> const & data)
+	{
+		auto identifiers = cryptography.digests({&data}, digest_names).get<skystream_identifiers>();
+		std::string skylink;
+		while (true) {
+			try {
+				skylink = portal.upload(sia::skynet::upload_data::borrowed("content", data.data(), data.size(), "application/octet-stream"));
+				break;
+			} catch(std::runtime_error const & e) {
+				std::cerr << e.what() << std::endl;
+				continue;
+			}
+		}
+		identifiers["skylink"] = skylink;
+		return identifiers;
+	}
+
+	struct fetched_block
+	{
+		node source;
+		std::vector<uint8_t> data;
+		double seconds;
+	};
+
+	static size_t content_size(node const & source)
+	{
+		auto & bytes = source.metadata.spans[span_kind::bytes];
+		return bytes.end > bytes.start ? size_t(bytes.end - bytes.start) : 0;
+	}
+
+	fetched_block fetch_block(span_kind span, double offset)
+	{
+		auto start = std::chrono::steady_clock::now();
+		fetched_block result;
+		std::optional<std::vector<uint8_t>> content;
+		result.source = find_node(span, offset, &content);
+		result.data = content ? std::move(*content) : get(result.source.metadata.identifiers, content_size(result.source));
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return result;
+	}
+
+	void queue_read_ahead(span_kind span, node const & source, size_t block_size)
+	{
+		double blocks = std::ceil(fetch_seconds / std::max(consume_seconds, 0.001)) + 1;
+		blocks = std::min({blocks, double(max_read_ahead_blocks), double(std::max<size_t>(1, read_ahead_bytes / std::max<size_t>(1, block_size)))});
+
+		// each block starts where the one before ends, so finding its metadata
+		// waits for theirs, but the content of all of them is fetched at once
+		std::shared_future<node> previous;
+		if (prefetched.empty()) {
+			std::promise<node> known;
+			known.set_value(source);
+			previous = known.get_future().share();
+		} else {
+			previous = prefetched.back().source;
+		}
+		while (prefetched.size() < blocks) {
+			auto found = std::make_shared<std::promise<node>>();
+			prefetch next{found->get_future().share(), {}};
+			next.block = std::async(std::launch::async, [this, span, previous, found]() {
+				auto start = std::chrono::steady_clock::now();
+				fetched_block result;
+				std::optional<std::vector<uint8_t>> content;
+				try {
+					double offset = previous.get().bounds[span].end;
+					result.source = find_node(span, offset, &content);
+					found->set_value(result.source);
+				} catch (...) {
+					// past the end, or the block before failed
+					found->set_exception(std::current_exception());
+					throw;
+				}
+				result.data = content ? std::move(*content) : get(result.source.metadata.identifiers, content_size(result.source));
+				result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				return result;
+			});
+			previous = next.source;
+			prefetched.push_back(std::move(next));
+		}
+	}
+
+	// fetches still running are kept until they finish, unless waiting for them
+	void drop_read_ahead(bool wait = false)
+	{
+		for (auto & dropped : prefetched) {
+			abandoned.emplace_back(std::move(dropped.block));
+		}
+		prefetched.clear();
+		if (wait) {
+			abandoned.clear();
+			return;
+		}
+		abandoned.erase(std::remove_if(abandoned.begin(), abandoned.end(), [](std::future<fetched_block> const & fetch) {
+			return fetch.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}), abandoned.end());
+	}
+
+	static void average(double & average, double sample)
+	{
+		average = average ? average + (sample - average) / 4 : sample;
+	}
+
+	void pipeline_worker()
+	{
+		std::unique_lock<std::mutex> lock(pipeline_mutex);
+		while (true) {
+			pipeline_changed.wait(lock, [&]{ return pipeline_stopping || !pipeline_queue.empty(); });
+			if (pipeline_queue.empty()) { return; }
+			// the block stays queued until it is written, so flush waits for it
+			auto & block = pipeline_queue.front();
+			lock.unlock();
+			std::exception_ptr error;
+			try {
+				write_block(*block.data, block.span, block.offset, block.end_time, block.content.get());
+			} catch (...) {
+				error = std::current_exception();
+			}
+			lock.lock();
+			if (error && !pipeline_error) { pipeline_error = error; }
+			pipeline_queue.pop_front();
+			pipeline_changed.notify_all();
+		}
+	}
+
 	sia::skynet portal;
 	crypto cryptography;
+	std::vector<std::string> digest_names = crypto::algorithms();
+	static constexpr unsigned max_attempts = 4; // for each download
 	node tail;
-	std::unordered_map<std::string, node> cache;
+	std::unordered_map<std::string, cached_entry> cache;
+	std::list<std::string> cache_recent; // unpinned nodes, most recently used first
+	std::vector<std::string> cache_pinned;
+	size_t cache_total = 0;
+	size_t cache_max_bytes = 64 * 1024 * 1024;
+	static constexpr unsigned pinned_levels = 2; // below the tail
+	node_cache_counters cache_counters;
+	struct indexed_block
+	{
+		skystream_identifiers identifiers; // of the metadata
+		skystream_spans bounds;
+	};
+	// blocks found so far by the start of their bounds, for each span kind
+	std::array<std::map<double, std::shared_ptr<indexed_block const>>, span_kind_count> span_index;
+	double indexed_bytes_end = 0;
+	std::mutex nodes_mutex; // guards looking up nodes in the above
+
+	struct prefetch
+	{
+		std::shared_future<node> source;
+		std::future<fetched_block> block;
+	};
+	static constexpr size_t max_read_ahead_blocks = 16;
+	size_t read_ahead_bytes = 64 * 1024 * 1024;
+	bool read_ahead_valid = false; // where a sequential read would go next
+	span_kind read_ahead_span = span_kind::bytes;
+	double read_ahead_next = 0;
+	std::chrono::steady_clock::time_point read_returned;
+	double fetch_seconds = 0; // moving averages
+	double consume_seconds = 0;
+	std::deque<prefetch> prefetched;
+	std::vector<std::future<fetched_block>> abandoned;
+
+	struct pending_block
+	{
+		std::shared_ptr<std::vector<uint8_t> const> data;
+		span_kind span;
+		double offset;
+		seconds_t end_time;
+		std::future<skystream_identifiers> content; // including the skylink
+	};
+	size_t pipeline_depth = 0;
+	bool pipeline_stopping = false;
+	std::deque<pending_block> pipeline_queue;
+	std::exception_ptr pipeline_error;
+	std::mutex pipeline_mutex; // guards the above
+	std::condition_variable pipeline_changed;
+	std::thread pipeline_thread;
 };
 
 /*
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+// the metadata document uploaded with each skystream block: the spans and
+// identifiers of the block's content, and lookup entries for finding the blocks
+// before it.  it is uploaded as cbor; streams written as json text still read.
+
+enum class span_kind { time, index, bytes };
+static constexpr size_t span_kind_count = 3;
+
+inline char const * span_name(span_kind kind)
+{
+	static char const * const names[span_kind_count] = {"time", "index", "bytes"};
+	return names[size_t(kind)];
+}
+
+inline span_kind span_named(std::string const & name)
+{
+	for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+		if (name == span_name(span_kind(kind))) { return span_kind(kind); }
+	}
+	throw std::runtime_error("Unknown span " + name);
+}
+
+struct skystream_span
+{
+	double start = 0;
+	double end = 0;
+
+	bool contains(double offset) const { return offset >= start && offset < end; }
+};
+
+// one span of each kind, indexed by span_kind
+struct skystream_spans
+{
+	std::array<skystream_span, span_kind_count> spans;
+
+	skystream_span & operator[](span_kind kind) { return spans[size_t(kind)]; }
+	skystream_span const & operator[](span_kind kind) const { return spans[size_t(kind)]; }
+};
+
+// digests by algorithm name, as hex, and the skylink
+using skystream_identifiers = std::map<std::string, std::string>;
+
+struct skystream_lookup
+{
+	skystream_identifiers identifiers;
+	skystream_spans spans;
+	unsigned long long depth = 0;
+};
+
+struct skystream_metadata
+{
+	skystream_spans spans; // of the content
+	skystream_identifiers identifiers; // of the content
+	std::vector<skystream_lookup> lookup;
+
+	// the cbor layout is an array of the version, the content spans, the content
+	// identifiers, and the lookup entries as arrays of spans, identifiers and depth.
+	// spans are arrays of [start, end] by span_kind, and digests are byte strings.
+	static constexpr unsigned version = 1;
+
+	std::vector<uint8_t> encode() const
+	{
+		nlohmann::json lookups = nlohmann::json::array();
+		for (auto & entry : lookup) {
+			lookups.push_back({encode(entry.spans), encode(entry.identifiers), entry.depth});
+		}
+		return nlohmann::json::to_cbor(nlohmann::json::array({version, encode(spans), encode(identifiers), lookups}));
+	}
+
+	static skystream_metadata decode(std::vector<uint8_t> const & data)
+	{
+		if (data.size() && data[0] == '{') {
+			return from_json(nlohmann::json::parse(data));
+		}
+		auto document = nlohmann::json::from_cbor(data);
+		if (!document.is_array() || document.size() < 4 || !document[0].is_number_unsigned()) {
+			throw std::runtime_error("Not skystream metadata");
+		}
+		if (document[0].get<unsigned>() != version) {
+			throw std::runtime_error("Unsupported skystream metadata version " + document[0].dump());
+		}
+		skystream_metadata result;
+		result.spans = decode_spans(document[1]);
+		result.identifiers = decode_identifiers(document[2]);
+		for (auto & entry : document[3]) {
+			result.lookup.push_back({decode_identifiers(entry.at(1)), decode_spans(entry.at(0)), entry.at(2).get<unsigned long long>()});
+		}
+		return result;
+	}
+
+	// the text form of the older streams, which is also handy for logging
+	nlohmann::json json() const
+	{
+		nlohmann::json lookups = nlohmann::json::array();
+		for (auto & entry : lookup) {
+			lookups.push_back({{"identifiers", entry.identifiers}, {"spans", json(entry.spans)}, {"depth", entry.depth}});
+		}
+		return {
+			{"content", {
+				{"spans", json(spans)},
+				{"identifiers", identifiers}
+			}},
+			{"lookup", lookups}
+		};
+	}
+
+	static skystream_metadata from_json(nlohmann::json const & document)
+	{
+		skystream_metadata result;
+		auto & content = document.at("content");
+		result.spans = json_spans(content.at("spans"));
+		result.identifiers = content.at("identifiers").get<skystream_identifiers>();
+		if (document.contains("lookup")) {
+			for (auto & entry : document["lookup"]) {
+				result.lookup.push_back({entry.at("identifiers").get<skystream_identifiers>(), json_spans(entry.at("spans")), entry.value("depth", 0ull)});
+			}
+		}
+		return result;
+	}
+
+private:
+	static nlohmann::json json(skystream_spans const & spans)
+	{
+		nlohmann::json result;
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			result[span_name(span_kind(kind))] = {{"start", spans.spans[kind].start}, {"end", spans.spans[kind].end}};
+		}
+		return result;
+	}
+
+	static skystream_spans json_spans(nlohmann::json const & value)
+	{
+		skystream_spans result;
+		for (size_t kind = 0; kind < span_kind_count; ++ kind) {
+			char const * name = span_name(span_kind(kind));
+			if (!value.contains(name)) { continue; }
+			result.spans[kind] = {value[name].at("start").get<double>(), value[name].at("end").get<double>()};
+		}
+		return result;
+	}
+
+	// whole numbers take fewer bytes as integers
+	static nlohmann::json encode(double value)
+	{
+		if (value >= 0 && value < 9007199254740992.0 && std::floor(value) == value) {
+			return (unsigned long long)value;
+		}
+		return value;
+	}
+
+	static nlohmann::json encode(skystream_spans const & spans)
+	{
+		nlohmann::json result = nlohmann::json::array();
+		for (auto & span : spans.spans) {
+			result.push_back({encode(span.start), encode(span.end)});
+		}
+		return result;
+	}
+
+	static skystream_spans decode_spans(nlohmann::json const & value)
+	{
+		skystream_spans result;
+		for (size_t kind = 0; kind < span_kind_count && kind < value.size(); ++ kind) {
+			result.spans[kind] = {value[kind].at(0).get<double>(), value[kind].at(1).get<double>()};
+		}
+		return result;
+	}
+
+	static nlohmann::json encode(skystream_identifiers const & identifiers)
+	{
+		nlohmann::json result = nlohmann::json::object();
+		for (auto & identifier : identifiers) {
+			std::vector<uint8_t> bytes;
+			if (identifier.first != "skylink" && unhex(identifier.second, bytes)) {
+				result[identifier.first] = nlohmann::json::binary(std::move(bytes));
+			} else {
+				result[identifier.first] = identifier.second;
+			}
+		}
+		return result;
+	}
+
+	static skystream_identifiers decode_identifiers(nlohmann::json const & value)
+	{
+		static char const hex[] = "0123456789abcdef";
+		skystream_identifiers result;
+		for (auto & identifier : value.items()) {
+			if (!identifier.value().is_binary()) {
+				result[identifier.key()] = identifier.value().get<std::string>();
+				continue;
+			}
+			auto & bytes = identifier.value().get_binary();
+			std::string text(bytes.size() * 2, 0);
+			for (size_t index = 0; index < bytes.size(); ++ index) {
+				text[index * 2] = hex[bytes[index] >> 4];
+				text[index * 2 + 1] = hex[bytes[index] & 0xf];
+			}
+			result[identifier.key()] = text;
+		}
+		return result;
+	}
+
+	// lowercase hex only, so that it is written back the same
+	static bool unhex(std::string const & text, std::vector<uint8_t> & bytes)
+	{
+		if (text.empty() || text.size() % 2) { return false; }
+		auto digit = [](char c) {
+			return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+		};
+		bytes.resize(text.size() / 2);
+		for (size_t index = 0; index < bytes.size(); ++ index) {
+			int high = digit(text[index * 2]), low = digit(text[index * 2 + 1]);
+			if (high < 0 || low < 0) { return false; }
+			bytes[index] = high << 4 | low;
+		}
+		return true;
+	}
+};
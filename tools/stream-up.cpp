@@ -9,7 +9,13 @@
 
 int main(int argc, char **argv)
 {
+	if (argc > 2) {
+		std::cerr << "Usage: " << argv[0] << " [blocks uploading at once, default 4]" << std::endl;
+		return -1;
+	}
 	skystream stream;
+	// reading stdin overlaps uploading the blocks before
+	stream.pipeline(argc == 2 ? std::stoul(argv[1]) : 4);
 
 	unsigned long long offset = 0;
 
@@ -19,9 +25,6 @@ int main(int argc, char **argv)
 
 	ssize_t size;
 
-	(void)argc;
-	(void)argv;
-
 	while ((size = read(0, data.data(), data.size()))) {
 		if (size < 0) {
 			perror("read");